@@ -0,0 +1,688 @@
+/*
+ * Throughput of the escape sequence parser.
+ *
+ * The same corpus is fed to three paths:
+ *   old       the ESC_* bit flag parser tputc used before the state machine,
+ *             transcribed below with its buffering and csiparse
+ *   new       the state machine of the emulator, driven by its vtparse tables
+ *   emulator  the whole TerminalEmulator, parsing and applying
+ *
+ * The two parsers count what they dispatch instead of acting on it, so both
+ * see the same work. Their counts are compared so a corpus they disagree on
+ * does not go unnoticed.
+ *
+ *   parsebench [file...]
+ *
+ * Without files it generates a few typical corpora. Recorded output, e.g. of
+ * script(1), can be given instead.
+ */
+#include "Hexe/Terminal/TerminalEmulator.h"
+#include "vtparse.h"
+
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace Hexe::Terminal;
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define LEN(a) (sizeof(a) / sizeof(a)[0])
+#define BETWEEN(x, a, b) ((a) <= (x) && (x) <= (b))
+#define ISCONTROLC0(c) ((c) < 0x20 || (c) == 0x7f)
+#define ISCONTROLC1(c) (BETWEEN(c, 0x80, 0x9f))
+#define ISCONTROL(c) (ISCONTROLC0(c) || ISCONTROLC1(c))
+
+#define RUNS 7
+#define UTF_SIZ 4
+#define ESC_ARG_MAX 65535
+
+/* what a parser dispatched */
+typedef struct
+{
+  long print, execute, esc, csi, str;
+  long sum; /* of CSI parameters and finals, and string lengths */
+} Counts;
+
+static int countscmp(const Counts *a, const Counts *b)
+{
+  return a->print != b->print || a->execute != b->execute || a->esc != b->esc ||
+         a->csi != b->csi || a->str != b->str || a->sum != b->sum;
+}
+
+static size_t utf8encode(Rune u, char *c)
+{
+  if (u < 0x80)
+  {
+    c[0] = u;
+    return 1;
+  }
+  if (u < 0x800)
+  {
+    c[0] = 0xc0 | u >> 6;
+    c[1] = 0x80 | (u & 0x3f);
+    return 2;
+  }
+  if (u < 0x10000)
+  {
+    c[0] = 0xe0 | u >> 12;
+    c[1] = 0x80 | (u >> 6 & 0x3f);
+    c[2] = 0x80 | (u & 0x3f);
+    return 3;
+  }
+  c[0] = 0xf0 | u >> 18;
+  c[1] = 0x80 | (u >> 12 & 0x3f);
+  c[2] = 0x80 | (u >> 6 & 0x3f);
+  c[3] = 0x80 | (u & 0x3f);
+  return 4;
+}
+
+/* both parsers take decoded runes, so decoding is not timed */
+static std::vector<Rune> utf8decodeall(const std::string &s)
+{
+  std::vector<Rune> r;
+  size_t i = 0, n, k;
+  Rune u;
+
+  while (i < s.size())
+  {
+    uchar c = s[i];
+    n = c < 0x80 ? 1 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+    u = n == 1 ? c : c & (0x7f >> n);
+    for (k = 1; k < n && i + k < s.size(); k++)
+      u = u << 6 | (s[i + k] & 0x3f);
+    r.push_back(u);
+    i += n;
+  }
+  return r;
+}
+
+/*
+ * The parser before the state machine. term.esc held a set of flags, CSI
+ * sequences were buffered and parsed with strtol once their final arrived.
+ */
+enum old_state
+{
+  OLD_START = 1,
+  OLD_CSI = 2,
+  OLD_STR = 4,
+  OLD_ALTCHARSET = 8,
+  OLD_STR_END = 16,
+  OLD_TEST = 32,
+  OLD_UTF8 = 64,
+};
+
+typedef struct
+{
+  int esc;
+  struct
+  {
+    char buf[ESC_BUF_SIZ];
+    size_t len;
+    char priv;
+    int arg[ESC_ARG_SIZ];
+    int narg;
+    char mode[2];
+  } csi;
+  struct
+  {
+    char type;
+    char *buf;
+    size_t siz, len;
+  } str;
+  Counts n;
+} OldParser;
+
+static void oldcsiparse(OldParser *p)
+{
+  char *s = p->csi.buf, *np;
+  long v;
+  int i;
+
+  p->csi.narg = 0;
+  if (*s == '?')
+  {
+    p->csi.priv = 1;
+    s++;
+  }
+
+  p->csi.buf[p->csi.len] = '\0';
+  while (s < p->csi.buf + p->csi.len)
+  {
+    np = NULL;
+    v = strtol(s, &np, 10);
+    if (np == s)
+      v = 0;
+    if (v == LONG_MAX || v == LONG_MIN)
+      v = -1;
+    p->csi.arg[p->csi.narg++] = v;
+    s = np;
+    if (*s != ';' || p->csi.narg == ESC_ARG_SIZ)
+      break;
+    s++;
+  }
+  p->csi.mode[0] = *s++;
+  p->csi.mode[1] = (s < p->csi.buf + p->csi.len) ? *s : '\0';
+
+  p->n.csi++;
+  for (i = 0; i < p->csi.narg; i++)
+    p->n.sum += p->csi.arg[i];
+  p->n.sum += p->csi.mode[0];
+}
+
+static void oldstrsequence(OldParser *p, uchar c)
+{
+  p->str.buf = (char *)realloc(p->str.buf, STR_BUF_SIZ);
+  p->str.siz = STR_BUF_SIZ;
+  p->str.len = 0;
+  p->str.type = c;
+  p->esc |= OLD_STR;
+}
+
+static void oldstrhandle(OldParser *p)
+{
+  p->esc &= ~(OLD_STR_END | OLD_STR);
+  p->n.str++;
+  p->n.sum += p->str.len;
+}
+
+static void oldcontrolcode(OldParser *p, uchar ascii)
+{
+  switch (ascii)
+  {
+  case '\t':
+  case '\b':
+  case '\r':
+  case '\f':
+  case '\v':
+  case '\n':
+  case '\016':
+  case '\017':
+    p->n.execute++;
+    return;
+  case '\a':
+    if (p->esc & OLD_STR_END)
+      oldstrhandle(p);
+    else
+      p->n.execute++;
+    break;
+  case '\033':
+    memset(&p->csi, 0, sizeof(p->csi));
+    p->esc &= ~(OLD_CSI | OLD_ALTCHARSET | OLD_TEST);
+    p->esc |= OLD_START;
+    return;
+  case '\032':
+  case '\030':
+    memset(&p->csi, 0, sizeof(p->csi));
+    p->n.execute++;
+    break;
+  case '\005':
+  case '\000':
+  case '\021':
+  case '\023':
+  case 0177:
+    p->n.execute++;
+    return;
+  case 0x90:
+  case 0x9d:
+  case 0x9e:
+  case 0x9f:
+    oldstrsequence(p, ascii);
+    return;
+  default:
+    p->n.execute++;
+    break;
+  }
+  p->esc &= ~(OLD_STR_END | OLD_STR);
+}
+
+/* returns 1 when the sequence is finished */
+static int oldeschandle(OldParser *p, uchar ascii)
+{
+  switch (ascii)
+  {
+  case '[':
+    p->esc |= OLD_CSI;
+    return 0;
+  case '#':
+    p->esc |= OLD_TEST;
+    return 0;
+  case '%':
+    p->esc |= OLD_UTF8;
+    return 0;
+  case 'P':
+  case '_':
+  case '^':
+  case ']':
+  case 'k':
+    oldstrsequence(p, ascii);
+    return 0;
+  case '(':
+  case ')':
+  case '*':
+  case '+':
+    p->esc |= OLD_ALTCHARSET;
+    return 0;
+  case '\\':
+    if (p->esc & OLD_STR_END)
+      oldstrhandle(p);
+    return 1;
+  }
+  p->n.esc++;
+  return 1;
+}
+
+static void oldputc(OldParser *p, Rune u)
+{
+  char c[UTF_SIZ];
+  size_t len;
+  int control = ISCONTROL(u);
+
+  if (u < 127)
+  {
+    c[0] = u;
+    len = 1;
+  }
+  else
+  {
+    len = utf8encode(u, c);
+  }
+
+  if (p->esc & OLD_STR)
+  {
+    if (u == '\a' || u == 030 || u == 032 || u == 033 || ISCONTROLC1(u))
+    {
+      p->esc &= ~(OLD_START | OLD_STR);
+      p->esc |= OLD_STR_END;
+      goto check_control_code;
+    }
+    if (p->str.len + len >= p->str.siz)
+    {
+      p->str.siz *= 2;
+      p->str.buf = (char *)realloc(p->str.buf, p->str.siz);
+    }
+    memmove(&p->str.buf[p->str.len], c, len);
+    p->str.len += len;
+    return;
+  }
+
+check_control_code:
+  if (control)
+  {
+    oldcontrolcode(p, u);
+    return;
+  }
+  else if (p->esc & OLD_START)
+  {
+    if (p->esc & OLD_CSI)
+    {
+      p->csi.buf[p->csi.len++] = u;
+      if (BETWEEN(u, 0x40, 0x7E) || p->csi.len >= sizeof(p->csi.buf) - 1)
+      {
+        p->esc = 0;
+        oldcsiparse(p);
+      }
+      return;
+    }
+    else if (p->esc & (OLD_UTF8 | OLD_ALTCHARSET | OLD_TEST))
+    {
+      p->n.esc++;
+    }
+    else if (!oldeschandle(p, u))
+    {
+      return;
+    }
+    p->esc = 0;
+    return;
+  }
+  p->n.print++;
+}
+
+static Counts oldparse(const std::vector<Rune> &r)
+{
+  OldParser p;
+  size_t i;
+
+  memset(&p, 0, sizeof(p));
+  for (i = 0; i < r.size(); i++)
+    oldputc(&p, r[i]);
+  free(p.str.buf);
+  return p.n;
+}
+
+/* The state machine, as tputc drives it */
+typedef struct
+{
+  int esc;
+  CSIEscape csi;
+  struct
+  {
+    char *buf;
+    size_t siz, len;
+  } str;
+  Counts n;
+} NewParser;
+
+static void newcsireset(NewParser *p)
+{
+  p->csi.priv = 0;
+  p->csi.inter = 0;
+  p->csi.sub = 0;
+  p->csi.narg = 0;
+  p->csi.mode = 0;
+  memset(p->csi.arg, 0, sizeof(p->csi.arg));
+}
+
+static void newputc(NewParser *p, Rune u)
+{
+  char c[UTF_SIZ];
+  size_t len = 0;
+  uchar t;
+  int i;
+
+  if (p->esc == ESC_STR)
+  {
+    if (u < 127)
+    {
+      c[0] = u;
+      len = 1;
+    }
+    else
+    {
+      len = utf8encode(u, c);
+    }
+  }
+
+  t = vtparse.t[p->esc][u < LEN(vtclass.c) ? vtclass.c[u] : (uchar)CL_HIGH];
+  p->esc = VT_STATE(t);
+
+  switch (VT_ACTION(t))
+  {
+  case ACT_NONE:
+    break;
+  case ACT_PRINT:
+    p->n.print++;
+    break;
+  case ACT_EXECUTE:
+    p->n.execute++;
+    break;
+  case ACT_CLEAR:
+    newcsireset(p);
+    break;
+  case ACT_COLLECT:
+    if (!p->csi.inter)
+      p->csi.inter = u;
+    break;
+  case ACT_PRIV:
+    p->csi.priv = u;
+    break;
+  case ACT_PARAM:
+    if (p->csi.narg < ESC_ARG_SIZ)
+    {
+      int *a = &p->csi.arg[p->csi.narg];
+      *a = MIN(*a * 10 + (int)(u - '0'), ESC_ARG_MAX);
+    }
+    break;
+  case ACT_SEP:
+    if (p->csi.narg < ESC_ARG_SIZ && ++p->csi.narg < ESC_ARG_SIZ && u == ':')
+      p->csi.sub |= 1u << p->csi.narg;
+    break;
+  case ACT_ESC_DISPATCH:
+    p->n.esc++;
+    break;
+  case ACT_CSI_DISPATCH:
+    p->csi.narg = MIN(p->csi.narg + 1, ESC_ARG_SIZ);
+    p->csi.mode = u;
+    p->n.csi++;
+    for (i = 0; i < p->csi.narg; i++)
+      p->n.sum += p->csi.arg[i];
+    p->n.sum += p->csi.mode;
+    break;
+  case ACT_STR_START:
+    if (!p->str.buf)
+    {
+      p->str.buf = (char *)malloc(STR_BUF_SIZ);
+      p->str.siz = STR_BUF_SIZ;
+    }
+    p->str.len = 0;
+    break;
+  case ACT_STR_PUT:
+    if (p->str.len + len >= p->str.siz)
+    {
+      p->str.siz *= 2;
+      p->str.buf = (char *)realloc(p->str.buf, p->str.siz);
+    }
+    memmove(&p->str.buf[p->str.len], c, len);
+    p->str.len += len;
+    break;
+  case ACT_STR_DISPATCH:
+    p->n.str++;
+    p->n.sum += p->str.len;
+    break;
+  }
+}
+
+static Counts newparse(const std::vector<Rune> &r)
+{
+  NewParser p;
+  size_t i;
+
+  memset(&p, 0, sizeof(p));
+  for (i = 0; i < r.size(); i++)
+    newputc(&p, r[i]);
+  free(p.str.buf);
+  return p.n;
+}
+
+/* The whole emulator, reading the corpus from a pty that never blocks */
+class CorpusPty : public IPseudoTerminal
+{
+public:
+  CorpusPty(const std::string &s) : m_s(s), m_pos(0) {}
+
+  bool IsTTY() const override { return true; }
+  int Write(const char *, size_t n) override { return (int)n; }
+  int Read(char *buf, size_t n, bool) override
+  {
+    n = MIN(n, m_s.size() - m_pos);
+    memcpy(buf, m_s.data() + m_pos, n);
+    m_pos += n;
+    return (int)n;
+  }
+  int GetNumColumns() const override { return 200; }
+  int GetNumRows() const override { return 60; }
+  bool Resize(int, int) override { return true; }
+
+  bool Done() const { return m_pos == m_s.size(); }
+
+private:
+  const std::string &m_s;
+  size_t m_pos;
+};
+
+class IdleProcess : public Hexe::System::IProcess
+{
+public:
+  void CheckExitStatus() override {}
+  bool HasExited() const override { return false; }
+  int GetExitCode() const override { return 0; }
+  void Terminate() override {}
+  void WaitForExit() override {}
+};
+
+class NullDisplay : public TerminalDisplay
+{
+public:
+  bool DrawBegin(int, int) override { return false; }
+  void DrawLine(Line, int, int, int) override {}
+  void DrawCursor(int, int, Glyph, int, int, Glyph) override {}
+  void DrawEnd() override {}
+};
+
+static void emulate(const std::string &s)
+{
+  auto display = std::make_shared<NullDisplay>();
+  auto pty = new CorpusPty(s);
+  auto terminal = TerminalEmulator::Create(
+      std::unique_ptr<IPseudoTerminal>(pty),
+      std::unique_ptr<Hexe::System::IProcess>(new IdleProcess()), display);
+
+  while (!pty->Done())
+    terminal->Update();
+}
+
+/* best of RUNS, in MB/s of the corpus */
+template <typename F>
+static double throughput(size_t bytes, F f)
+{
+  double best = 0;
+  int i;
+
+  for (i = 0; i < RUNS; i++)
+  {
+    auto t0 = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - t0;
+    if (i == 0 || d.count() < best)
+      best = d.count();
+  }
+  return bytes / best / 1e6;
+}
+
+static unsigned int seed = 1;
+
+static unsigned int rnd(unsigned int n)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 8) % n;
+}
+
+static const char *words[] = {
+    "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog",
+    "request", "served", "error", "warning", "src/TerminalEmulator.cpp",
+};
+static const char *wide[] = {
+    "\xe6\xbc\xa2\xe5\xad\x97", "\xe3\x81\x8b\xe3\x81\xaa", "\xed\x95\x9c\xea\xb8\x80",
+    "\xf0\x9f\x98\x80", "\xf0\x9f\x9a\x80", "\xc3\xa9t\xc3\xa9", "\xce\xb1\xce\xb2\xce\xb3",
+};
+
+/* colored output, ls --color or compiler diagnostics */
+static std::string gensgr(size_t size)
+{
+  std::string s;
+
+  while (s.size() < size)
+  {
+    s += "\033[" + std::to_string(rnd(2)) + ";3" + std::to_string(rnd(8)) + "m";
+    s += words[rnd(LEN(words))];
+    if (rnd(4) == 0)
+      s += "\033[38;5;" + std::to_string(rnd(256)) + "m";
+    if (rnd(8) == 0)
+      s += "\033[48;2;" + std::to_string(rnd(256)) + ";" + std::to_string(rnd(256)) + ";" + std::to_string(rnd(256)) + "m";
+    s += rnd(10) ? "\033[m " : "\033[m\r\n";
+  }
+  return s;
+}
+
+/* full screen redraws, as htop, vim or tmux send them */
+static std::string gentui(size_t size)
+{
+  std::string s;
+  int y, x;
+
+  while (s.size() < size)
+  {
+    s += "\033[?2026h\033[?25l\033[H";
+    for (y = 1; y <= 60; y++)
+    {
+      s += "\033[" + std::to_string(y) + ";1H\033[7m" + std::to_string(y) + "\033[27m ";
+      for (x = rnd(8); x > 0; x--)
+      {
+        s += "\033[" + std::to_string(rnd(2)) + ";3" + std::to_string(rnd(8)) + "m";
+        s += words[rnd(LEN(words))];
+        s += ' ';
+      }
+      s += "\033[K";
+    }
+    s += "\033]0;htop - " + std::to_string(rnd(1000)) + "\a";
+    s += "\033]2;vim\033\\";
+    s += "\0337\033[60;1H\033[1;44m NORMAL \033[m\0338\033[?25h\033[?2026l";
+  }
+  return s;
+}
+
+/* text in other scripts */
+static std::string gencjk(size_t size)
+{
+  std::string s;
+
+  while (s.size() < size)
+  {
+    s += wide[rnd(LEN(wide))];
+    s += rnd(12) ? " " : "\r\n";
+  }
+  return s;
+}
+
+/* plain logs, cat or tail -f */
+static std::string genlog(size_t size)
+{
+  std::string s;
+  int i = 0;
+
+  while (s.size() < size)
+  {
+    s += "2026-10-17 12:00:" + std::to_string(i % 60) + " INFO request " + std::to_string(rnd(100000));
+    s += " served in " + std::to_string(rnd(1000)) + "ms path=/api/v1/items/" + std::to_string(i++) + "\r\n";
+  }
+  return s;
+}
+
+static void bench(const char *name, const std::string &s)
+{
+  std::vector<Rune> r = utf8decodeall(s);
+  Counts a, b;
+  double old, cur, emu;
+
+  a = oldparse(r);
+  b = newparse(r);
+
+  old = throughput(s.size(), [&]() { oldparse(r); });
+  cur = throughput(s.size(), [&]() { newparse(r); });
+  emu = throughput(s.size(), [&]() { emulate(s); });
+
+  printf("%-16s %8.1f %8.1f %8.1f MB/s %6.2fx%s\n", name, old, cur, emu, cur / old,
+         countscmp(&a, &b) ? "  (parsers disagree)" : "");
+}
+
+int main(int argc, char *argv[])
+{
+  int i;
+
+  printf("%-16s %8s %8s %8s\n", "corpus", "old", "new", "emulator");
+  if (argc > 1)
+  {
+    for (i = 1; i < argc; i++)
+    {
+      std::ifstream f(argv[i], std::ios::binary);
+      if (!f)
+      {
+        fprintf(stderr, "parsebench: cannot open %s\n", argv[i]);
+        return 1;
+      }
+      bench(argv[i], std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>()));
+    }
+    return 0;
+  }
+
+  bench("sgr", gensgr(8 << 20));
+  bench("tui", gentui(8 << 20));
+  bench("cjk/emoji", gencjk(8 << 20));
+  bench("log", genlog(8 << 20));
+  return 0;
+}
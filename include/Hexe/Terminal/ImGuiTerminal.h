@@ -26,7 +26,9 @@
 #include "Hexe/System/IProcessFactory.h"
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 #include "imgui.h"
 
 namespace Hexe
@@ -84,6 +86,7 @@ namespace Hexe
 
             std::string m_title;
             ImVector<Hexe::Terminal::Glyph> m_buffer;
+            std::unordered_map<int, std::vector<Hexe::Terminal::Rune>> m_marks; /* of the ATTR_CLUSTER cells in m_buffer */
             ImVector<std::pair<ImU32, std::string>> m_colors;
             std::shared_ptr<Hexe::Terminal::TerminalEmulator> m_terminal;
             mutable std::string m_clipboardLast;
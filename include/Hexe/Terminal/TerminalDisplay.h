@@ -33,6 +33,7 @@ namespace Hexe
         protected:
             int m_mode;
             cursor_mode m_cursorMode;
+            int m_scrollOffset;
             TerminalEmulator *m_emulator;
 
         public:
@@ -63,6 +64,10 @@ namespace Hexe
             virtual void SetClipboard(const char *text);
             virtual const char *GetClipboard() const;
 
+            /* history lines shown above the screen, clamped by the emulator as it draws */
+            inline void SetScrollOffset(int offset) { m_scrollOffset = offset > 0 ? offset : 0; }
+            inline int GetScrollOffset() const { return m_scrollOffset; }
+
             virtual bool DrawBegin(int columns, int rows) = 0;
             virtual void DrawLine(Line line, int x1, int y, int x2) = 0;
             virtual void DrawCursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og) = 0;
@@ -39,6 +39,7 @@
 #include "TerminalDisplay.h"
 #include "IPseudoTerminal.h"
 #include "../System/IProcess.h"
+#include <chrono>
 #include <memory>
 #include <stdint.h>
 #include <sys/types.h>
@@ -54,22 +55,157 @@ namespace Hexe
         constexpr int ESC_ARG_SIZ = 16;
         constexpr int STR_BUF_SIZ = ESC_BUF_SIZ;
         constexpr int STR_ARG_SIZ = ESC_ARG_SIZ;
+        constexpr int SGR_CACHE_SIZ = 64; /* a power of two */
+        constexpr int SGR_KEY_SIZ = 40;
+        constexpr int BLANK_ROWS = 4;
+        constexpr int CLUSTER_MAX = 16;       /* runes of a glyph, marks included */
+        constexpr int CLUSTER_POOL_MAX = 1 << 20;
+        constexpr int HIST_PAGE_SIZ = 64 * 1024; /* bytes of a scrollback page */
+        constexpr int HIST_PAGE_LINES = 512;     /* most lines a page holds */
+
+        /*
+         * Runes of the glyphs with ATTR_CLUSTER, one pool per screen. An
+         * entry is a count followed by the base rune and its marks.
+         */
+        typedef struct
+        {
+            Rune *buf;
+            int len; /* runes used, old entries included */
+            int siz; /* runes allocated */
+        } ClusterPool;
+
+        typedef struct HistPage HistPage;
+        typedef struct History History;
+
+        /* Where the compressed lines of a packed page are */
+        enum hist_state
+        {
+            HIST_MEM,     /* after the header */
+            HIST_WRITING, /* after the header of the page in next, being written */
+            HIST_DISK     /* in the spill file at off */
+        };
+
+        /*
+         * A scrollback page, from a pool shared by every terminal. A raw page
+         * is HIST_PAGE_SIZ bytes: the header, the end of each line in cells,
+         * then the cells of its lines without trailing blanks. A packed page
+         * only keeps the header and its compressed lines, a spilled one only
+         * the header. Lines are whole, rows soft wrapped on the screen are
+         * joined back, and only split when they outgrow a page.
+         */
+        struct HistPage
+        {
+            HistPage *prev;  /* pages of all terminals in memory, oldest first */
+            HistPage *next;  /* or the next free page */
+            History *owner;
+            uint start;      /* npushed of its first row, once counted */
+            int nline;
+            int rows;        /* at hist.cols, estimated until counted */
+            int ncell;       /* cells of its lines, once packed */
+            int packed;      /* bytes after the header once packed, 0 while raw */
+            int state;       /* of a packed page */
+            int64_t off;     /* in the spill file, -1 if it could not be written */
+        };
+
+        /* Lines scrolled off the top of the primary screen */
+        struct History
+        {
+            HistPage **pages; /* ring of siz slots, a power of two */
+            int head;         /* slot of the oldest page */
+            int npage;
+            int siz;
+            int first;        /* lines of the oldest page already dropped */
+            int nline;        /* lines kept */
+            int cols;         /* width rows are counted at */
+            int counted;      /* oldest page whose rows are counted, the newer ones are */
+            int nrows;        /* rows kept, the estimates included */
+            int lastoff;      /* first cell of the last row of the newest line */
+            uint npushed;     /* rows ever pushed, wraps around */
+            HistPage *unpacked; /* packed page held by the cache, if any */
+            Glyph *cache;       /* its cells, the u of a cluster indexes marks */
+            ushort *cacheoff;   /* end of each of its lines */
+            Rune *marks;        /* rune count then runes, of each cluster */
+            int nmarks;
+            int marksiz;
+            int nspill;       /* oldest pages written or being written out */
+            int fd;           /* spill file, -1 until opened, -2 if it cannot be */
+            int64_t spillend; /* bytes of it handed out */
+            uchar *map;       /* window of it last read */
+            int64_t mapoff;
+            size_t mapsiz;
+        };
+
+        typedef struct Regex Regex;
+
+        /*
+         * A search of the screen and the scrollback, newest lines first. It
+         * goes a page of the scrollback at a time, so it can be spread over
+         * frames; the lines of a page go through a literal prefilter first.
+         */
+        typedef struct
+        {
+            Regex *rx;           /* compiled pattern, NULL when none runs */
+            int screen;          /* whether the screen is still to be searched */
+            int over;            /* whether the scrollback was searched */
+            uint next;           /* rows of the scrollback before it are still to be searched */
+            SearchMatch *found;  /* matches not handed out yet */
+            int nfound;
+            int nsent;
+            int foundsiz;
+            Rune *runes;         /* of a line, without the dummies of wide chars */
+            int *at;             /* cell of each of them in the line */
+            int runesiz;
+            uchar cand[HIST_PAGE_LINES]; /* lines of a page the prefilter let through */
+        } Search;
+
+        /* Damaged columns of a line, clean when x1 >= x2 */
+        typedef struct
+        {
+            int x1; /* first dirty col */
+            int x2; /* one past the last dirty col */
+        } DirtySpan;
 
         /* Internal representation of the screen */
         typedef struct
         {
             int row;         /* nb row */
             int col;         /* nb col */
-            Line *line;      /* screen */
-            Line *alt;       /* alternate screen */
-            int *dirty;      /* dirtyness of lines */
+            CellLine *line;    /* screen, a window into ring */
+            CellLine *alt;     /* alternate screen, a window into altring, NULL until shown */
+            CellLine *ring;    /* 2 * row lines, the second half mirrors the first */
+            CellLine *altring;
+            Cell *slab;      /* rows of both screens, slabrows rows of stride cells */
+            void *slabmem;   /* allocation behind the aligned slab */
+            int stride;      /* cells per slab row */
+            int slabrows;    /* rows the slab has room for, enough for each screen */
+            int *attrcnt;    /* cells with a tracked attribute, per slab row */
+            Cell *blank;     /* BLANK_ROWS shared blank rows after the slab rows */
+            int blankref[BLANK_ROWS]; /* lines pointing at each blank row */
+            int *freerows;   /* stack of the slab rows no line points at */
+            int nfree;
+            ClusterPool clusters;    /* of the screen shown */
+            ClusterPool altclusters; /* of the other one */
+#ifdef HEXE_COMPACT_CELLS
+            Glyph *styles;      /* interned (mode, fg, bg), u is unused */
+            uint32_t *stylemap; /* open addressed index + 1 of each style */
+            uint32_t nstyles;
+            uint32_t stylecap;  /* a power of two, stylemap has 2 * stylecap slots */
+            Glyph lastattr;     /* last interned attribute and its style */
+            uint32_t laststyle;
+#endif
+            Glyph *drawbuf;   /* a row expanded for the display */
+            History hist;     /* scrollback */
+            int scr;          /* history lines shown above the screen */
+            uint hdrawn;      /* hist.npushed at the last draw */
+            DirtySpan *dirty; /* dirty columns of lines */
             TCursor c;       /* cursor */
+            TCursor saved[2]; /* cursor saved by DECSC, of each screen */
             int ocx;         /* old cursor col */
             int ocy;         /* old cursor row */
             int top;         /* top    scroll limit */
             int bot;         /* bottom scroll limit */
             int mode;        /* terminal mode flags */
-            int esc;         /* escape state flags */
+            int esc;         /* escape parser state */
             char trantbl[4]; /* charset table translation */
             int charset;     /* current charset */
             int icharset;    /* selected charset for sequence */
@@ -78,25 +214,45 @@ namespace Hexe
         } Term;
 
         /* CSI Escape sequence structs */
-        /* ESC '[' [[ [<priv>] <arg> [;]] <mode> [<mode>]] */
+        /* ESC '[' [[ [<priv>] <arg> [;:]] [<inter>] <mode>] */
         typedef struct
         {
-            char buf[ESC_BUF_SIZ]; /* raw string */
-            size_t len;            /* raw string length */
-            char priv;
+            char priv;  /* private marker, 0 if none */
+            char inter; /* intermediate, 0 if none */
             int arg[ESC_ARG_SIZ];
+            uint sub; /* bit n set if arg n is a ':' sub-parameter */
             int narg; /* nb of args */
-            char mode[2];
+            char mode; /* final char */
         } CSIEscape;
 
+        /* Effect of an SGR sequence on the cursor attributes */
+        typedef struct
+        {
+            ushort set;  /* mode bits to set */
+            ushort clr;  /* mode bits to clear */
+            uchar fgset; /* whether fg is replaced */
+            uchar bgset; /* whether bg is replaced */
+            uint32_t fg;
+            uint32_t bg;
+        } SGRDelta;
+
+        /* A recently seen SGR sequence, keyed on its parameter bytes */
+        typedef struct
+        {
+            int len; /* key length + 1, 0 if the slot is empty */
+            char key[SGR_KEY_SIZ];
+            SGRDelta d;
+        } SGRCache;
+
         /* STR Escape sequence structs */
         /* ESC type [[ [<priv>] <arg> [;]] <mode>] ESC '\' */
         typedef struct
         {
             char type;  /* ESC type ... */
-            char *buf;  /* allocated raw string */
-            size_t siz; /* allocation size */
-            size_t len; /* raw string length */
+            char *buf;    /* raw string, kept for the next one */
+            size_t siz;   /* allocation size */
+            size_t len;   /* raw string length */
+            int overflow; /* longer than strmaxlen, dropped */
             char *args[STR_ARG_SIZ];
             int narg; /* nb of args */
         } STREscape;
@@ -129,11 +285,18 @@ namespace Hexe
             char m_buf[8192];
             int m_buflen;
 
+            std::chrono::steady_clock::time_point m_syncStart;
+            std::chrono::steady_clock::time_point m_altLeft;
+
         private:
             Term term;
             Selection sel;
+            Search srch;
             CSIEscape csiescseq;
             STREscape strescseq;
+            SGRCache sgrcache[SGR_CACHE_SIZ];
+            SGRDelta sgrlast; /* effect of the last SGR sequence */
+            int sgrok;        /* whether it was parsed without errors */
 
             uint32_t defaultfg;
             uint32_t defaultbg;
@@ -155,10 +318,9 @@ namespace Hexe
         private:
             void csidump();
             void csihandle();
-            void csiparse();
             void csireset();
 
-            int eschandle(uchar);
+            void eschandle(uchar);
 
             void strdump();
             void strhandle();
@@ -179,23 +341,61 @@ namespace Hexe
             void tmoveto(int, int);
             void tmoveato(int, int);
             void tnewline(int);
+            int tscrollahead(const char *, size_t);
             void tputtab(int);
             void tputc(Rune);
+            void tputglyph(Rune);
+            size_t tputascii(const char *, size_t);
+            size_t tputsgr(const char *, size_t);
             void treset();
             void tscrollup(int, int);
             void tscrolldown(int, int);
-            void tsetattr(int *, int);
+            void tmirror(int, int);
+            void tlinearize();
+            void tnewslab(int, int, int, int);
+            void tallocrows(int, int, int);
+            void taltnew();
+            void taltfree();
+            int tshareblank(int, Cell);
+            CellLine tunshare(int);
+#ifdef HEXE_COMPACT_CELLS
+            uint32_t tstyle(const Glyph *);
+            void tstylegc();
+            Glyph cellglyph(const Cell &);
+#endif
+            void tsetattr(int *, int, uint);
+            int tsgrparse(int *, int, uint, SGRDelta *);
+            void tsgrapply(const SGRDelta *);
             void tsetchar(Rune, Glyph *, int, int);
+            int tcombine(Rune, int);
+            int tclusteralloc(int);
+            void tclustergc();
+            size_t cellencode(const Cell &, char *);
             void tsetdirt(int, int);
+            void tsetdirtspan(int, int, int);
+            void tcountattr(int);
             void tsetscroll(int, int);
             void tswapscreen();
+            void tunwrap();
+            void trewrap();
+            void thpush(int);
+            void thclear();
+            void thresize(int);
+            void thcount(int);
+            int thpage(uint);
+            int thline(int, Glyph *);
+            void thpack();
+            void thpackpage(int);
+            void thunpack(HistPage *);
+            int tsearchscreen();
+            int tsearchpage(int);
             void tsetmode(int, int, int *, int);
             int twrite(const char *, int, int);
             void tfulldirt();
             void tcontrolcode(uchar);
             void tdectest(char);
             void tdefutf8(char);
-            int32_t tdefcolor(int *, int *, int);
+            int32_t tdefcolor(int *, int *, int, uint);
             void tdeftran(char);
             void tstrsequence(uchar);
 
@@ -206,6 +406,7 @@ namespace Hexe
         private:
             void _die(const char *, ...);
             void drawregion(TerminalDisplay &dpy, int, int, int, int);
+            void drawhistory(TerminalDisplay &dpy);
             void draw();
 
             int tattrset(int);
@@ -226,6 +427,8 @@ namespace Hexe
             void selstart(int, int, int);
             void selextend(int, int, int, int);
             int selected(int, int);
+            int selspan(int, int *, int *);
+            const Rune *GetCluster(const Glyph &, int *) const;
             char *getsel();
 
         private:
@@ -269,6 +472,12 @@ namespace Hexe
             inline uint32_t GetDefaultReverseCursorColor() const { return defaultrcs; }
             inline int GetNumColumns() const { return term.col; }
             inline int GetNumRows() const { return term.row; }
+            inline int GetNumHistoryLines() const { return term.hist.nrows; }
+            /* row -n is the n-th row of the scrollback, shown with a scroll offset of n */
+            inline int GetScreenRow(uint row) const { return (int)(row - term.hist.npushed); }
+            int SearchStart(const char *pattern, int flags);
+            int SearchStep(SearchMatch *matches, int max);
+            void SearchCancel();
             inline int Write(const char *buf, size_t buflen) { return m_pty->Write(buf, (int)buflen); }
 
         public:
@@ -0,0 +1,61 @@
+// The MIT License (MIT)
+
+// Copyright (c) 2020 Fredrik A. Kristiansen
+
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+#pragma once
+
+namespace Hexe
+{
+    namespace Terminal
+    {
+        /*
+         * What the per-character loop of the emulator has to handle. The core
+         * is built with TerminalTraits, which is DefaultTerminalTraits unless
+         * HEXE_TERMINAL_TRAITS_HEADER names a header declaring another one,
+         * usually derived from it. Branches a trait turns off are constant
+         * and compiled out.
+         *
+         * The traits are chosen once per build of the library, like
+         * HEXE_COMPACT_CELLS: every TerminalEmulator in a process shares
+         * them, and code built against the library must see the same
+         * HEXE_TERMINAL_TRAITS_HEADER.
+         */
+        struct DefaultTerminalTraits
+        {
+            static constexpr bool utf8only = false; /* ESC % @ is ignored, input is always utf8 */
+            static constexpr bool printer = true;   /* MODE_PRINT copies output to the printer */
+            static constexpr bool boxdraw = true;   /* box drawing runes get ATTR_BOXDRAW */
+            static constexpr bool emoji = true;     /* emoji get ATTR_EMOJI */
+            static constexpr bool showctrl = true;  /* twrite may echo control chars */
+        };
+    } // namespace Terminal
+} // namespace Hexe
+
+#ifdef HEXE_TERMINAL_TRAITS_HEADER
+#include HEXE_TERMINAL_TRAITS_HEADER
+#else
+namespace Hexe
+{
+    namespace Terminal
+    {
+        typedef DefaultTerminalTraits TerminalTraits;
+    } // namespace Terminal
+} // namespace Hexe
+#endif
@@ -80,6 +80,7 @@ namespace Hexe
             ATTR_WDUMMY = 1 << 10,
             ATTR_BOXDRAW = 1 << 11,
             ATTR_EMOJI = 1 << 12,
+            ATTR_CLUSTER = 1 << 13, /* u indexes the emulator's cluster pool */
             ATTR_BOLD_FAINT = ATTR_BOLD | ATTR_FAINT,
         };
 
@@ -119,6 +120,23 @@ namespace Hexe
 
         typedef Glyph *Line;
 
+#ifdef HEXE_COMPACT_CELLS
+        /*
+         * Compact screen cell: the rune shares a word with the layout flags
+         * (ATTR_WRAP to ATTR_CLUSTER), colors and the remaining attributes are
+         * interned in the emulator's style table
+         */
+        typedef struct
+        {
+            uint32_t u;     /* rune in bits 0-20, layout flags above */
+            uint32_t style; /* index into the style table */
+        } Cell;
+#else
+        typedef Glyph Cell;
+#endif
+
+        typedef Cell *CellLine;
+
         union Arg
         {
             int i;
@@ -147,6 +165,7 @@ namespace Hexe
             MODE_ECHO = 1 << 4,
             MODE_PRINT = 1 << 5,
             MODE_UTF8 = 1 << 6,
+            MODE_SYNC = 1 << 7,
         };
 
         enum cursor_movement
@@ -173,15 +192,19 @@ namespace Hexe
             CS_FIN
         };
 
+        /* states of the escape sequence parser, see vtparse */
         enum escape_state
         {
-            ESC_START = 1,
-            ESC_CSI = 2,
-            ESC_STR = 4, /* DCS, OSC, PM, APC */
-            ESC_ALTCHARSET = 8,
-            ESC_STR_END = 16, /* a final string was encountered */
-            ESC_TEST = 32,    /* Enter in test mode */
-            ESC_UTF8 = 64,
+            ESC_GROUND = 0,
+            ESC_ESCAPE,
+            ESC_ESCAPE_INTER,
+            ESC_CSI_ENTRY,
+            ESC_CSI_PARAM,
+            ESC_CSI_INTER,
+            ESC_CSI_IGNORE,
+            ESC_STR,     /* DCS, OSC, PM, APC */
+            ESC_STR_ESC, /* ESC inside a string, ST may follow */
+            ESC_NSTATES
         };
 
         typedef struct
@@ -211,5 +234,24 @@ namespace Hexe
 
             int alt;
         } Selection;
+
+        enum search_flag
+        {
+            SEARCH_ICASE = 1 << 0,   /* letters match in either case */
+            SEARCH_LITERAL = 1 << 1, /* the pattern is plain text, not a regex */
+        };
+
+        /*
+         * A match of a search, from its first to its last cell. Rows are
+         * numbered by the rows pushed to the scrollback before them, so they
+         * stay put while output scrolls, see GetScreenRow.
+         */
+        typedef struct
+        {
+            int x0;
+            uint y0;
+            int x1;
+            uint y1;
+        } SearchMatch;
     } // namespace Terminal
 } // namespace Hexe
\ No newline at end of file
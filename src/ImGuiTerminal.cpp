@@ -276,6 +276,9 @@ void ImGuiTerminal::MouseReport(int x, int y, int button, int state, int type)
         return;
     }
 
+    // Selections are made in screen rows, below the history shown
+    y = MAX(y - m_scrollOffset, 0);
+
     if (type == 1)
     {
         int tx = x;
@@ -330,6 +333,12 @@ void ImGuiTerminal::ProcessInput(int mouse_column, int mouse_row)
         }
     }
 
+    // Without mouse reporting the wheel scrolls through the history
+    if (isHovered && io.MouseWheel != 0.0f && !(m_mode & MODE_MOUSE))
+    {
+        SetScrollOffset(m_scrollOffset + (int)(io.MouseWheel * 3.0f));
+    }
+
     auto keyModFlags = io.KeyMods;
 
     // Process regular text input (before we check for Return because using some IME will effectively send a Return?)
@@ -345,6 +354,7 @@ void ImGuiTerminal::ProcessInput(int mouse_column, int mouse_row)
             {
                 ImTextStrToUtf8(utf8Input.data(), utf8InputLen + 1, io.InputQueueCharacters.Data, io.InputQueueCharacters.end());
                 m_terminal->Write(utf8Input.data(), (size_t)utf8InputLen);
+                SetScrollOffset(0);
                 io.InputQueueCharacters.resize(0);
             }
         }
@@ -547,6 +557,7 @@ bool ImGuiTerminal::DrawBegin(int columns, int rows)
     {
         Hexe::Terminal::Glyph defaultGlyph;
         m_buffer.resize(columns * rows, defaultGlyph);
+        m_marks.clear();
         m_columns = columns;
         m_rows = rows;
     }
@@ -558,10 +569,31 @@ bool ImGuiTerminal::DrawBegin(int columns, int rows)
 void ImGuiTerminal::DrawLine(Hexe::Terminal::Line line, int x1, int y, int x2)
 {
     m_checkDirty = true;
-    memcpy(&m_buffer[y * m_columns + x1], line, (x2 - x1) * sizeof(Glyph));
+    memcpy(&m_buffer[y * m_columns + x1], &line[x1], (x2 - x1) * sizeof(Glyph));
+
+    // Cluster indices do not outlive the draw, so the marks are copied now
     for (int i = x1; i < x2; i++)
     {
-        if (m_terminal->selected(i, y))
+        auto &glyph = m_buffer[y * m_columns + i];
+        if (!m_marks.empty())
+            m_marks.erase(y * m_columns + i);
+        if (glyph.mode & ATTR_CLUSTER)
+        {
+            int n;
+            auto runes = m_terminal->GetCluster(glyph, &n);
+            glyph.u = n > 0 ? runes[0] : ' ';
+            if (n > 1)
+                m_marks[y * m_columns + i].assign(runes + 1, runes + n);
+            else
+                glyph.mode &= ~ATTR_CLUSTER;
+        }
+    }
+
+    // Selections are kept in screen rows, which sit below the history shown
+    int sx0, sx1;
+    if (m_terminal->selspan(y - m_scrollOffset, &sx0, &sx1))
+    {
+        for (int i = MAX(x1, sx0); i < x2 && i <= sx1; i++)
         {
             m_buffer[y * m_columns + i].mode |= ATTR_REVERSE;
         }
@@ -573,6 +605,12 @@ void ImGuiTerminal::DrawCursor(int cx, int cy, Hexe::Terminal::Glyph g, int ox,
     m_cursorx = cx;
     m_cursory = cy;
     m_cursorg = g;
+    if (g.mode & ATTR_CLUSTER)
+    {
+        int n;
+        auto runes = m_terminal->GetCluster(g, &n);
+        m_cursorg.u = n > 0 ? runes[0] : ' ';
+    }
 }
 
 void ImGuiTerminal::DrawEnd()
@@ -675,10 +713,13 @@ void ImGuiTerminal::DrawImGui(ImDrawList *draw_list, ImVec2 pos, float scale, co
 
     ImU32 col = 0xFFFFFFFF;
 
-    // 4 vertices per primitive, up to 11 primitives pr char (background, glyph (up to 8 because of boxdraw), strikethrough, underline) and the cursor
-    const int vtx_count_max = (int)(m_columns * m_rows) * 4 * 11 + 16;
-    // 6 indices per primitive, up to 4 primitives pr char (background, glyph, strikethrough, underline) and the cursor
-    const int idx_count_max = (int)(m_columns * m_rows) * 6 * 11 + 24;
+    // Up to 8 primitives for the glyph of a char: the rects of a boxdraw char, or a font glyph and the marks over it
+    const int glyph_prims_max = 8;
+    // Up to 11 primitives pr char (background, glyph, strikethrough, underline) and 5 for the cursor
+    const int prims_max = (int)(m_columns * m_rows) * (1 + glyph_prims_max + 2) + 5;
+    // 4 vertices and 6 indices per primitive
+    const int vtx_count_max = prims_max * 4;
+    const int idx_count_max = prims_max * 6;
     const int idx_expected_size = drawList->IdxBuffer.Size + idx_count_max;
     drawList->PrimReserve(idx_count_max, vtx_count_max);
 
@@ -912,6 +953,44 @@ void ImGuiTerminal::DrawImGui(ImDrawList *draw_list, ImVec2 pos, float scale, co
                         }
                     }
                 }
+
+                // Marks go over the base glyph, as many as fit in the primitives reserved for it
+                auto marks = (glyph.mode & ATTR_CLUSTER) && fg != bg ? m_marks.find(j * m_columns + i) : m_marks.end();
+                for (int k = 0; marks != m_marks.end() && k < (int)marks->second.size() && k < glyph_prims_max - 1; k++)
+                {
+                    auto markGlyph = font->FindGlyphNoFallback(marks->second[k]);
+                    if (!markGlyph || !markGlyph->Visible)
+                        continue;
+
+                    float x1 = x + markGlyph->X0 * scale;
+                    float x2 = x + markGlyph->X1 * scale;
+                    float y1 = y + markGlyph->Y0 * scale;
+                    float y2 = y + markGlyph->Y1 * scale;
+                    if (x1 < clip_rect.x || x2 > clip_rect.z || y1 < clip_rect.y || y2 > clip_rect.w)
+                        continue;
+
+                    idx_write[0] = (ImDrawIdx)(vtx_current_idx);
+                    idx_write[1] = (ImDrawIdx)(vtx_current_idx + 1);
+                    idx_write[2] = (ImDrawIdx)(vtx_current_idx + 2);
+                    idx_write[3] = (ImDrawIdx)(vtx_current_idx);
+                    idx_write[4] = (ImDrawIdx)(vtx_current_idx + 2);
+                    idx_write[5] = (ImDrawIdx)(vtx_current_idx + 3);
+                    vtx_write[0].pos = ImVec2(x1, y1);
+                    vtx_write[0].col = fg;
+                    vtx_write[0].uv = ImVec2(markGlyph->U0, markGlyph->V0);
+                    vtx_write[1].pos = ImVec2(x2, y1);
+                    vtx_write[1].col = fg;
+                    vtx_write[1].uv = ImVec2(markGlyph->U1, markGlyph->V0);
+                    vtx_write[2].pos = ImVec2(x2, y2);
+                    vtx_write[2].col = fg;
+                    vtx_write[2].uv = ImVec2(markGlyph->U1, markGlyph->V1);
+                    vtx_write[3].pos = ImVec2(x1, y2);
+                    vtx_write[3].col = fg;
+                    vtx_write[3].uv = ImVec2(markGlyph->U0, markGlyph->V1);
+                    vtx_write += 4;
+                    vtx_current_idx += 4;
+                    idx_write += 6;
+                }
             }
 
             if (glyph.mode & ATTR_UNDERLINE)
@@ -977,7 +1056,8 @@ void ImGuiTerminal::DrawImGui(ImDrawList *draw_list, ImVec2 pos, float scale, co
     }
 
     {
-        if (!IS_SET(MODE_HIDE))
+        // The cursor is below the view while history fills it
+        if (!IS_SET(MODE_HIDE) && m_cursory < m_rows)
         {
             ImU32 drawcol;
 
@@ -986,7 +1066,7 @@ void ImGuiTerminal::DrawImGui(ImDrawList *draw_list, ImVec2 pos, float scale, co
             {
                 m_cursorg.mode |= ATTR_REVERSE;
                 m_cursorg.bg = m_emulator->GetDefaultForeground();
-                if (m_emulator->IsSelected(m_cursorx, m_cursory))
+                if (m_emulator->IsSelected(m_cursorx, m_cursory - m_scrollOffset))
                 {
                     drawcol = GetCol(m_emulator->GetDefaultCursorColor(), m_colors);
                     m_cursorg.fg = m_emulator->GetDefaultReverseCursorColor();
@@ -999,7 +1079,7 @@ void ImGuiTerminal::DrawImGui(ImDrawList *draw_list, ImVec2 pos, float scale, co
             }
             else
             {
-                if (m_emulator->IsSelected(m_cursorx, m_cursory))
+                if (m_emulator->IsSelected(m_cursorx, m_cursory - m_scrollOffset))
                 {
                     m_cursorg.fg = m_emulator->GetDefaultForeground();
                     m_cursorg.bg = m_emulator->GetDefaultReverseCursorColor();
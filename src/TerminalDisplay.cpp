@@ -28,7 +28,7 @@
 using namespace Hexe::Terminal;
 
 TerminalDisplay::TerminalDisplay()
-    : m_mode(MODE_VISIBLE), m_cursorMode(SteadyBar), m_emulator(nullptr)
+    : m_mode(MODE_VISIBLE), m_cursorMode(SteadyBar), m_scrollOffset(0), m_emulator(nullptr)
 {
 }
 void TerminalDisplay::Attach(TerminalEmulator *terminal)
@@ -34,8 +34,10 @@
 //  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
 //  DEALINGS IN THE SOFTWARE.
 #include "Hexe/Terminal/TerminalEmulator.h"
+#include "Hexe/Terminal/TerminalTraits.h"
 #include "boxdraw_data.h"
-#include "emoji_blocks.h"
+#include "unicode_props.h"
+#include "vtparse.h"
 
 #include <assert.h>
 #include <ctype.h>
@@ -48,9 +50,30 @@
 #include <string.h>
 #include <signal.h>
 #include <sys/types.h>
+#include <wctype.h>
 #include "config.def.h"
 #include <cmath>
 
+#ifndef WIN32
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HEXE_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#define HEXE_AVX2
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
 #define LEN(a) (sizeof(a) / sizeof(a)[0])
@@ -70,42 +93,120 @@
 /* Arbitrary sizes */
 #define UTF_INVALID 0xFFFD
 #define UTF_SIZ 4
+#define UTF_BATCH 1024
+#define ESC_ARG_MAX 65535 /* larger CSI parameters are clamped */
+#define SLAB_ALIGN 64
+#define STYLE_INIT 64
+#define LZ_MINMATCH 4
+#define LZ_HASHBITS 12
+#define RX_PROG_MAX (1 << 16) /* instructions of a search pattern */
+#define RX_DEPTH_MAX 64       /* groups and repeats nested in one */
+#define RX_REP_MAX 1000       /* largest count of a {n,m} */
+#define RX_LIT_MAX 64         /* runes of the literal of one */
 
 /* macros */
 #define IS_SET(flag) ((term.mode & (flag)) != 0)
+/* constant when the traits rule the mode out */
+#define UTF8MODE() (TerminalTraits::utf8only || IS_SET(MODE_UTF8))
+#define PRINTING() (TerminalTraits::printer && IS_SET(MODE_PRINT))
 #define ISCONTROLC0(c) (BETWEEN(c, 0, 0x1f) || (c) == 0x7f)
 #define ISCONTROLC1(c) (BETWEEN(c, 0x80, 0x9f))
 #define ISCONTROL(c) (ISCONTROLC0(c) || ISCONTROLC1(c))
 #define ISDELIM(u) (u && Hexe_wcschr(worddelimiters, u))
 
-using namespace Hexe::Terminal;
+/* compose an SGR attribute into the effect of its sequence */
+#define SGR_SET(d, m) ((d)->set |= (m))
+#define SGR_CLR(d, m) ((d)->clr |= (m), (d)->set &= ~(m))
+#define SGR_FG(d, c) ((d)->fg = (c), (d)->fgset = 1)
+#define SGR_BG(d, c) ((d)->bg = (c), (d)->bgset = 1)
 
-static inline bool is_emoji_presentation(int32_t code)
-{
-    const emoji_range_t **curr = emoji_ranges;
-    while (*curr != 0)
-    {
-        if (code >= (*curr)->min_code && code <= (*curr)->max_code)
-        {
-            int ofs = code - (*curr)->min_code;
+/*
+ * Attributes counted per line, so finding them does not scan the screen.
+ * The count lives with the slab row, which follows the line when it scrolls.
+ */
+#define TRACKED_ATTR ATTR_BLINK
+#define ATTRCNT(l) (term.attrcnt[((l) - term.slab) / term.stride])
 
-            int byteOffset = ofs / 8;
-            int bit = 1 << (ofs % 8);
-            auto byte = (*curr)->bitmap[byteOffset];
+/*
+ * A line that was only cleared since it last had a slab row points at one
+ * of the shared blank rows instead. Anything that writes into a line goes
+ * through WLINE, which gives it a slab row of its own first.
+ */
+#define ISSHARED(l) ((l) >= term.blank)
+#define BLANKIDX(l) (int)(((l) - term.blank) / term.stride)
+#define WLINE(y) (ISSHARED(term.line[y]) ? tunshare(y) : term.line[y])
 
-            return ((*curr)->bitmap[byteOffset] & bit) == bit;
-        }
-        ++curr;
-    }
-    return false;
-}
+/*
+ * Page k of a scrollback from its oldest. In a raw page HISTOFF is the end
+ * of each line in cells, HISTSTART the first cell of a line.
+ */
+#define HISTPAGE(h, k) ((h)->pages[((h)->head + (k)) & ((h)->siz - 1)])
+#define HISTOFF(p) ((ushort *)((p) + 1))
+#define HISTCELLS(p) ((Cell *)(HISTOFF(p) + HIST_PAGE_LINES))
+#define HISTSTART(p, i) ((i) ? HISTOFF(p)[(i) - 1] : 0)
+#define HISTSIZ(p) ((p)->packed ? sizeof(HistPage) + (p)->packed : (size_t)HIST_PAGE_SIZ)
+#define HIST_PAGE_CELLS \
+    ((int)((HIST_PAGE_SIZ - sizeof(HistPage) - HIST_PAGE_LINES * sizeof(ushort)) / sizeof(Cell)))
+#define HIST_MAP_SIZ (1 << 20) /* spill files are mapped in windows of this */
+/* what a search pays, in cells scanned, to unpack a cell and to run one through the regex */
+#define SEARCH_UNPACK_COST 3
+#define SEARCH_RX_COST 4
+
+/*
+ * Screen cells are only touched through these, so the grid can be stored
+ * either as plain Glyphs or as compact Cells. CELL_FLAGS only carries the
+ * layout flags (ATTR_WRAP to ATTR_CLUSTER), CELL_MODE every attribute.
+ * CELL_RAW is the stored rune, the cluster pool index of an ATTR_CLUSTER
+ * cell, CELL_U always the base rune.
+ */
+#ifdef HEXE_COMPACT_CELLS
+#define CELL_LAYOUT (ATTR_WRAP | ATTR_WIDE | ATTR_WDUMMY | ATTR_BOXDRAW | ATTR_EMOJI | ATTR_CLUSTER)
+#define CELL_SHIFT 13
+#define CELL_RUNE 0x1FFFFF
+#define CELL_RAW(c) ((Rune)((c).u & CELL_RUNE))
+#define CELL_FLAGS(c) ((ushort)((c).u >> CELL_SHIFT & CELL_LAYOUT))
+#define CELL_MODE(c) (CELL_FLAGS(c) | term.styles[(c).style].mode)
+#define CELL_SETU(c, r) ((c).u = ((c).u & ~CELL_RUNE) | (r))
+#define CELL_SETFLAG(c, f) ((c).u |= (uint32_t)(f) << CELL_SHIFT)
+#define CELL_CLRFLAG(c, f) ((c).u &= ~((uint32_t)(f) << CELL_SHIFT))
+#define CELL_SET(c, r, g, s) \
+    ((c).u = (r) | (uint32_t)((g)->mode & CELL_LAYOUT) << CELL_SHIFT, (c).style = (s))
+#define CELL_STYLE(g) tstyle(g)
+#define CELL_GLYPH(c) cellglyph(c)
+#define CELL_EQ(a, b) ((a).u == (b).u && (a).style == (b).style)
+#define CELL_ATTREQ(a, b) ((((a).u ^ (b).u) & ~CELL_RUNE) == 0 && (a).style == (b).style)
+#else
+#define CELL_RAW(c) ((c).u)
+#define CELL_FLAGS(c) ((c).mode)
+#define CELL_MODE(c) ((c).mode)
+#define CELL_SETU(c, r) ((c).u = (r))
+#define CELL_SETFLAG(c, f) ((c).mode |= (f))
+#define CELL_CLRFLAG(c, f) ((c).mode &= ~(f))
+#define CELL_SET(c, r, g, s) ((c) = *(g), (c).u = (r), (void)(s))
+#define CELL_STYLE(g) 0
+#define CELL_GLYPH(c) (c)
+#define CELL_EQ(a, b) ((a).u == (b).u && !ATTRCMP(a, b))
+#define CELL_ATTREQ(a, b) (!ATTRCMP(a, b))
+#endif
+#define CELL_U(c) \
+    (CELL_FLAGS(c) & ATTR_CLUSTER ? term.clusters.buf[CELL_RAW(c) + 1] : CELL_RAW(c))
 
-static inline bool
-is_emoji(int32_t code)
+using namespace Hexe::Terminal;
+
+/* packed per code point by tools/gen-unicode-props.py */
+enum uprop_flags
+{
+    UPROP_WIDTH = 3, /* display width + 1 */
+    UPROP_EMOJI = 1 << 2,
+    UPROP_BOXDRAW = 1 << 3,
+};
+
+static inline uchar
+uprops(Rune u)
 {
-    if (is_emoji_presentation(code))
-        return true;
-    return false;
+    if (u >= UPROP_MAX)
+        return (u & 0xfffe) == 0xfffe ? 0 : 2;
+    return uprop_stage2[uprop_stage1[u >> UPROP_SHIFT]][u & ((1 << UPROP_SHIFT) - 1)];
 }
 
 static size_t Hexe_wcslen(const Rune *s)
@@ -133,9 +234,7 @@ static const Rune utfmax[UTF_SIZ + 1] = {0x10FFFF, 0x7F, 0x7FF, 0xFFFF, 0x10FFFF
 
 int Hexe::Terminal::isboxdraw(Rune u)
 {
-    Rune block = u & ~0xff;
-    return (block == 0x2500 && boxdata[u & 0xFF]) ||
-           (block == 0x2800);
+    return (uprops(u) & UPROP_BOXDRAW) != 0;
 }
 
 /* the "index" is actually the entire shape data encoded as ushort */
@@ -182,35 +281,74 @@ xstrdup(char *s)
 }
 
 static size_t utf8decode(const char *, Rune *, size_t);
-static Rune utf8decodebyte(char, size_t *);
+static size_t utf8decodebatch(const char *, size_t, Rune *, uchar *, size_t, size_t *);
 static char utf8encodebyte(Rune, size_t);
 static size_t utf8validate(Rune *, size_t);
 static size_t utf8encode(Rune, char *);
 
-static char *base64dec(const char *);
+static char *base64dec(char *);
 static char base64dec_getc(const char **);
 
+static size_t lzpack(const uchar *, size_t, uchar *);
+static long lzunpack(const uchar *, size_t, uchar *, size_t);
+
 static intmax_t xwrite(int, const char *, size_t);
 
+static size_t asciirun(const char *, size_t);
+static void cellfill(Cell *, Cell, int);
+static int celltrim(const Cell *, Cell, int);
+
+static inline int
+ctz32(uint32_t x)
+{
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, x);
+    return (int)i;
+#else
+    return __builtin_ctz(x);
+#endif
+}
+
+/* sequence length by lead byte, 0 for continuation and invalid bytes */
+struct UTF8LeadTable
+{
+    uchar len[256];
+};
+
+static constexpr UTF8LeadTable
+utf8leadbuild(void)
+{
+    UTF8LeadTable tab{};
+    int c = 0;
+
+    for (c = 0; c < 256; c++)
+        tab.len[c] = c < 0x80 ? 1 : c < 0xC0 ? 0 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : c < 0xF8 ? 4 : 0;
+    return tab;
+}
+
+static constexpr UTF8LeadTable utf8lead = utf8leadbuild();
+
 size_t
 utf8decode(const char *c, Rune *u, size_t clen)
 {
-    size_t i, j, len, type;
+    size_t i, len;
     Rune udecoded;
 
     *u = UTF_INVALID;
     if (!clen)
         return 0;
-    udecoded = utf8decodebyte(c[0], &len);
-    if (!BETWEEN(len, 1, UTF_SIZ))
+    len = utf8lead.len[(uchar)c[0]];
+    if (!len)
         return 1;
-    for (i = 1, j = 1; i < clen && j < len; ++i, ++j)
+    udecoded = (uchar)c[0] & ~utfmask[len];
+    for (i = 1; i < clen && i < len; ++i)
     {
-        udecoded = (udecoded << 6) | utf8decodebyte(c[i], &type);
-        if (type != 0)
-            return j;
+        if (((uchar)c[i] & 0xC0) != 0x80)
+            return i;
+        udecoded = (udecoded << 6) | ((uchar)c[i] & 0x3F);
     }
-    if (j < len)
+    if (i < len)
         return 0;
     *u = udecoded;
     utf8validate(u, len);
@@ -218,13 +356,186 @@ utf8decode(const char *c, Rune *u, size_t clen)
     return len;
 }
 
-Rune utf8decodebyte(char c, size_t *i)
+#ifdef HEXE_SSE2
+/* bytes of v whose bits under mask equal bits */
+static inline __m128i
+utf8match(__m128i v, int mask, int bits)
 {
-    for (*i = 0; *i < LEN(utfmask); ++(*i))
-        if (((uchar)c & utfmask[*i]) == utfbyte[*i])
-            return (uchar)c & ~utfmask[*i];
+    return _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char)mask)), _mm_set1_epi8((char)bits));
+}
 
-    return 0;
+/* lanes of b where m is set, of a elsewhere */
+static inline __m128i
+utf8blend(__m128i a, __m128i b, __m128i m)
+{
+    return _mm_or_si128(_mm_andnot_si128(m, a), _mm_and_si128(m, b));
+}
+
+/*
+ * Runes of 8 sequences of up to 3 bytes, widened to 16 bit lanes: b0 to
+ * b2 hold their bytes, m2 and m3 are set where 2 and 3 bytes are used.
+ */
+static inline __m128i
+utf8decode8(__m128i b0, __m128i b1, __m128i b2, __m128i m2, __m128i m3)
+{
+    __m128i x3f = _mm_set1_epi16(0x3F);
+    __m128i r2, r3;
+
+    b1 = _mm_and_si128(b1, x3f);
+    r2 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b0, _mm_set1_epi16(0x1F)), 6), b1);
+    r3 = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(b0, 12), _mm_slli_epi16(b1, 6)),
+                      _mm_and_si128(b2, x3f));
+
+    return utf8blend(utf8blend(b0, r2, m2), r3, m3);
+}
+
+/*
+ * Decodes the sequences that start in the first 16 of the 32 bytes at s.
+ * Every byte is decoded as if a sequence started there, and the runes of
+ * the lead bytes are then packed into u and ulen. Returns their number and
+ * sets *used, or returns 0 for a block that is not well formed or holds a
+ * rune past the BMP, which is left to utf8decode.
+ */
+static size_t
+utf8decodeblock(const char *s, Rune *u, uchar *ulen, size_t *used)
+{
+    __m128i z = _mm_setzero_si128();
+    __m128i v = _mm_loadu_si128((const __m128i *)s);
+    __m128i w, v1, v2, m2, m3, bad;
+    alignas(16) uint16_t dec[16];
+    alignas(16) uchar len[16];
+    uint32_t cont, l2, l3, lead, seq, end, m;
+    size_t k = 0;
+
+    if (_mm_movemask_epi8(utf8match(v, 0xF0, 0xF0)))
+        return 0;
+    w = _mm_loadu_si128((const __m128i *)(s + 16));
+    v1 = _mm_loadu_si128((const __m128i *)(s + 1));
+    v2 = _mm_loadu_si128((const __m128i *)(s + 2));
+    m2 = utf8match(v, 0xE0, 0xC0);
+    m3 = utf8match(v, 0xF0, 0xE0);
+    cont = _mm_movemask_epi8(utf8match(v, 0xC0, 0x80)) | _mm_movemask_epi8(utf8match(w, 0xC0, 0x80)) << 16;
+    l2 = _mm_movemask_epi8(m2);
+    l3 = _mm_movemask_epi8(m3);
+
+    /*
+     * the last sequence starting in the block ends at the first byte past
+     * it that is no continuation. Up to that byte, continuations must be
+     * where the lead bytes announce them. Overlong forms and surrogates
+     * are told by their first two bytes.
+     */
+    if (!(~cont >> 16))
+        return 0;
+    end = 16 + ctz32(~cont >> 16);
+    m = (1u << end) - 1;
+    seq = l2 << 1 | l3 << 1 | l3 << 2;
+    lead = ~cont & m;
+    bad = _mm_or_si128(utf8match(v, 0xFE, 0xC0),
+                       _mm_or_si128(_mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)0xE0)),
+                                                  utf8match(v1, 0xE0, 0x80)),
+                                    _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)0xED)),
+                                                  utf8match(v1, 0xE0, 0xA0))));
+    if ((cont ^ seq) & m || seq >> end & 1 || lead & _mm_movemask_epi8(bad))
+        return 0;
+
+    _mm_store_si128((__m128i *)len, _mm_sub_epi8(_mm_set1_epi8(1), _mm_add_epi8(m2, _mm_add_epi8(m3, m3))));
+    _mm_store_si128((__m128i *)dec,
+                    utf8decode8(_mm_unpacklo_epi8(v, z), _mm_unpacklo_epi8(v1, z), _mm_unpacklo_epi8(v2, z),
+                                _mm_unpacklo_epi8(m2, m2), _mm_unpacklo_epi8(m3, m3)));
+    _mm_store_si128((__m128i *)(dec + 8),
+                    utf8decode8(_mm_unpackhi_epi8(v, z), _mm_unpackhi_epi8(v1, z), _mm_unpackhi_epi8(v2, z),
+                                _mm_unpackhi_epi8(m2, m2), _mm_unpackhi_epi8(m3, m3)));
+
+    for (; lead; lead &= lead - 1, k++)
+    {
+        u[k] = dec[ctz32(lead)];
+        ulen[k] = len[ctz32(lead)];
+    }
+    *used = end;
+
+    return k;
+}
+#endif
+
+/*
+ * Decode up to maxu runes from s into u, storing the byte length of each
+ * one in ulen. Blocks of plain ASCII are widened, and well formed blocks
+ * within the BMP decoded, without going through utf8decode. Stops early at
+ * an incomplete sequence at the end of s; *used receives the number of
+ * bytes consumed.
+ */
+size_t
+utf8decodebatch(const char *s, size_t n, Rune *u, uchar *ulen, size_t maxu,
+                size_t *used)
+{
+    size_t i = 0, k = 0, len, m;
+
+    while (i < n && k < maxu)
+    {
+#if defined(HEXE_AVX2)
+        if (n - i >= 32 && maxu - k >= 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+            if (_mm256_movemask_epi8(v) == 0)
+            {
+                __m128i lo = _mm256_castsi256_si128(v);
+                __m128i hi = _mm256_extracti128_si256(v, 1);
+                _mm256_storeu_si256((__m256i *)(u + k), _mm256_cvtepu8_epi32(lo));
+                _mm256_storeu_si256((__m256i *)(u + k + 8), _mm256_cvtepu8_epi32(_mm_srli_si128(lo, 8)));
+                _mm256_storeu_si256((__m256i *)(u + k + 16), _mm256_cvtepu8_epi32(hi));
+                _mm256_storeu_si256((__m256i *)(u + k + 24), _mm256_cvtepu8_epi32(_mm_srli_si128(hi, 8)));
+                _mm256_storeu_si256((__m256i *)(ulen + k), _mm256_set1_epi8(1));
+                i += 32;
+                k += 32;
+                continue;
+            }
+        }
+#elif defined(HEXE_SSE2)
+        if (n - i >= 16 && maxu - k >= 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+            if (_mm_movemask_epi8(v) == 0)
+            {
+                __m128i z = _mm_setzero_si128();
+                __m128i lo = _mm_unpacklo_epi8(v, z);
+                __m128i hi = _mm_unpackhi_epi8(v, z);
+                _mm_storeu_si128((__m128i *)(u + k), _mm_unpacklo_epi16(lo, z));
+                _mm_storeu_si128((__m128i *)(u + k + 4), _mm_unpackhi_epi16(lo, z));
+                _mm_storeu_si128((__m128i *)(u + k + 8), _mm_unpacklo_epi16(hi, z));
+                _mm_storeu_si128((__m128i *)(u + k + 12), _mm_unpackhi_epi16(hi, z));
+                _mm_storeu_si128((__m128i *)(ulen + k), _mm_set1_epi8(1));
+                i += 16;
+                k += 16;
+                continue;
+            }
+        }
+#endif
+#ifdef HEXE_SSE2
+        /* other blocks are left to utf8decode */
+        if (n - i >= 32 && maxu - k >= 16)
+        {
+            if ((len = utf8decodeblock(s + i, &u[k], &ulen[k], &m)) > 0)
+            {
+                i += m;
+                k += len;
+                continue;
+            }
+        }
+#endif
+        if ((uchar)s[i] < 0x80)
+        {
+            u[k] = (uchar)s[i++];
+            ulen[k++] = 1;
+            continue;
+        }
+        if (!(len = utf8decode(s + i, &u[k], n - i)))
+            break;
+        ulen[k++] = len;
+        i += len;
+    }
+    *used = i;
+
+    return k;
 }
 
 size_t
@@ -283,15 +594,15 @@ char base64dec_getc(const char **src)
     return **src ? *((*src)++) : '='; /* emulate padding if string ends */
 }
 
+/*
+ * decodes in place, 4 chars are read before at most 3 are written
+ */
 char *
-base64dec(const char *src)
+base64dec(char *buf)
 {
-    size_t in_len = strlen(src);
-    char *result, *dst;
+    const char *src = buf;
+    char *dst = buf;
 
-    if (in_len % 4)
-        in_len += 4 - (in_len % 4);
-    result = dst = (char *)xmalloc(in_len / 4 * 3 + 1);
     while (*src)
     {
         int a = base64_digits[(unsigned char)base64dec_getc(&src)];
@@ -312,7 +623,130 @@ base64dec(const char *src)
         *dst++ = ((c & 0x03) << 6) | d;
     }
     *dst = '\0';
-    return result;
+    return buf;
+}
+
+/*
+ * LZ77 in the LZ4 block layout: a token with the literal count in its high
+ * nibble and the match length - LZ_MINMATCH in its low one, 15 continuing
+ * in the bytes after it, then the literals and a two byte offset back. The
+ * last sequence has no offset. dst needs n + n / 255 + 16 bytes.
+ */
+static uchar *
+lzputlen(uchar *o, size_t n)
+{
+    for (; n >= 255; n -= 255)
+        *o++ = 255;
+    *o++ = (uchar)n;
+    return o;
+}
+
+size_t
+lzpack(const uchar *src, size_t n, uchar *dst)
+{
+    static uint32_t table[1 << LZ_HASHBITS];
+    uchar *o = dst;
+    size_t i = 0, anchor = 0, cand, len, lit;
+    uint64_t a, b;
+    uint32_t v;
+
+    memset(table, 0, sizeof(table));
+    while (i + LZ_MINMATCH <= n)
+    {
+        memcpy(&v, src + i, sizeof(v));
+        v = (v * 2654435761u) >> (32 - LZ_HASHBITS);
+        cand = table[v];
+        table[v] = (uint32_t)i + 1;
+        if (!cand-- || i - cand > 0xFFFF || memcmp(src + cand, src + i, LZ_MINMATCH))
+        {
+            i++;
+            continue;
+        }
+        /* long matches are common in padded lines, extend them by words */
+        for (len = LZ_MINMATCH; i + len + 8 <= n; len += 8)
+        {
+            memcpy(&a, src + cand + len, 8);
+            memcpy(&b, src + i + len, 8);
+            if (a != b)
+                break;
+        }
+        for (; i + len < n && src[cand + len] == src[i + len]; len++)
+            /* nothing */;
+
+        lit = i - anchor;
+        *o++ = (uchar)(MIN(lit, 15) << 4 | MIN(len - LZ_MINMATCH, 15));
+        if (lit >= 15)
+            o = lzputlen(o, lit - 15);
+        memcpy(o, src + anchor, lit);
+        o += lit;
+        *o++ = (uchar)(i - cand);
+        *o++ = (uchar)((i - cand) >> 8);
+        if (len - LZ_MINMATCH >= 15)
+            o = lzputlen(o, len - LZ_MINMATCH - 15);
+        i += len;
+        anchor = i;
+    }
+
+    lit = n - anchor;
+    *o++ = (uchar)(MIN(lit, 15) << 4);
+    if (lit >= 15)
+        o = lzputlen(o, lit - 15);
+    memcpy(o, src + anchor, lit);
+    o += lit;
+    return o - dst;
+}
+
+/* the length of the data unpacked into dst, -1 if src is not valid */
+long
+lzunpack(const uchar *src, size_t n, uchar *dst, size_t max)
+{
+    const uchar *s = src, *end = src + n;
+    uchar *o = dst, *oend = dst + max;
+    size_t lit, len, off;
+    uchar t;
+
+    while (s < end)
+    {
+        t = *s++;
+        lit = t >> 4;
+        if (lit == 15)
+        {
+            do
+            {
+                if (s >= end)
+                    return -1;
+                lit += *s;
+            } while (*s++ == 255);
+        }
+        if (lit > (size_t)(end - s) || lit > (size_t)(oend - o))
+            return -1;
+        memcpy(o, s, lit);
+        o += lit;
+        s += lit;
+        if (s == end)
+            break;
+
+        if (end - s < 2)
+            return -1;
+        off = s[0] | s[1] << 8;
+        s += 2;
+        len = (t & 15) + LZ_MINMATCH;
+        if ((t & 15) == 15)
+        {
+            do
+            {
+                if (s >= end)
+                    return -1;
+                len += *s;
+            } while (*s++ == 255);
+        }
+        if (!off || off > (size_t)(o - dst) || len > (size_t)(oend - o))
+            return -1;
+        /* matches may overlap what they copy */
+        for (; len > 0; len--, o++)
+            *o = o[-(long)off];
+    }
+    return o - dst;
 }
 
 void TerminalEmulator::selinit(void)
@@ -326,10 +760,10 @@ int TerminalEmulator::tlinelen(int y)
 {
     int i = term.col;
 
-    if (term.line[y][i - 1].mode & ATTR_WRAP)
+    if (CELL_FLAGS(term.line[y][i - 1]) & ATTR_WRAP)
         return i;
 
-    while (i > 0 && term.line[y][i - 1].u == ' ')
+    while (i > 0 && CELL_U(term.line[y][i - 1]) == ' ')
         --i;
 
     return i;
@@ -411,22 +845,40 @@ void TerminalEmulator::selnormalize(void)
 }
 
 int TerminalEmulator::selected(int x, int y)
+{
+    int x0, x1;
+
+    return selspan(y, &x0, &x1) && BETWEEN(x, x0, x1);
+}
+
+/*
+ * Returns whether row y has selected cells, and if so the first and last
+ * selected column in *x0 and *x1, so callers can test whole runs at once.
+ */
+int TerminalEmulator::selspan(int y, int *x0, int *x1)
 {
     if (sel.mode == SEL_EMPTY || sel.ob.x == -1 ||
-        sel.alt != IS_SET(MODE_ALTSCREEN))
+        sel.alt != IS_SET(MODE_ALTSCREEN) || !BETWEEN(y, sel.nb.y, sel.ne.y))
         return 0;
 
     if (sel.type == SEL_RECTANGULAR)
-        return BETWEEN(y, sel.nb.y, sel.ne.y) && BETWEEN(x, sel.nb.x, sel.ne.x);
-
-    return BETWEEN(y, sel.nb.y, sel.ne.y) && (y != sel.nb.y || x >= sel.nb.x) && (y != sel.ne.y || x <= sel.ne.x);
+    {
+        *x0 = sel.nb.x;
+        *x1 = sel.ne.x;
+    }
+    else
+    {
+        *x0 = y == sel.nb.y ? sel.nb.x : 0;
+        *x1 = y == sel.ne.y ? sel.ne.x : term.col - 1;
+    }
+    return *x0 <= *x1;
 }
 
 void TerminalEmulator::selsnap(int *x, int *y, int direction)
 {
     int newx, newy, xt, yt;
     int delim, prevdelim;
-    Glyph *gp, *prevgp;
+    Cell *gp, *prevgp;
 
     switch (sel.snap)
     {
@@ -436,7 +888,7 @@ void TerminalEmulator::selsnap(int *x, int *y, int direction)
 		 * beginning of a line.
 		 */
         prevgp = &term.line[*y][*x];
-        prevdelim = ISDELIM(prevgp->u);
+        prevdelim = ISDELIM(CELL_U(*prevgp));
         for (;;)
         {
             newx = *x + direction;
@@ -452,7 +904,7 @@ void TerminalEmulator::selsnap(int *x, int *y, int direction)
                     yt = *y, xt = *x;
                 else
                     yt = newy, xt = newx;
-                if (!(term.line[yt][xt].mode & ATTR_WRAP))
+                if (!(CELL_FLAGS(term.line[yt][xt]) & ATTR_WRAP))
                     break;
             }
 
@@ -460,8 +912,8 @@ void TerminalEmulator::selsnap(int *x, int *y, int direction)
                 break;
 
             gp = &term.line[newy][newx];
-            delim = ISDELIM(gp->u);
-            if (!(gp->mode & ATTR_WDUMMY) && (delim != prevdelim || (delim && gp->u != prevgp->u)))
+            delim = ISDELIM(CELL_U(*gp));
+            if (!(CELL_FLAGS(*gp) & ATTR_WDUMMY) && (delim != prevdelim || (delim && CELL_U(*gp) != CELL_U(*prevgp))))
                 break;
 
             *x = newx;
@@ -481,7 +933,7 @@ void TerminalEmulator::selsnap(int *x, int *y, int direction)
         {
             for (; *y > 0; *y += direction)
             {
-                if (!(term.line[*y - 1][term.col - 1].mode & ATTR_WRAP))
+                if (!(CELL_FLAGS(term.line[*y - 1][term.col - 1]) & ATTR_WRAP))
                 {
                     break;
                 }
@@ -491,7 +943,7 @@ void TerminalEmulator::selsnap(int *x, int *y, int direction)
         {
             for (; *y < term.row - 1; *y += direction)
             {
-                if (!(term.line[*y][term.col - 1].mode & ATTR_WRAP))
+                if (!(CELL_FLAGS(term.line[*y][term.col - 1]) & ATTR_WRAP))
                 {
                     break;
                 }
@@ -505,14 +957,14 @@ char *
 TerminalEmulator::getsel(void)
 {
     char *str, *ptr;
-    int y, bufsize, lastx, linelen;
-    Glyph *gp, *last;
+    int y, bufsize, cap, off, lastx, linelen;
+    Cell *gp, *last;
 
     if (sel.ob.x == -1)
         return NULL;
 
-    bufsize = (term.col + 1) * (sel.ne.y - sel.nb.y + 1) * UTF_SIZ;
-    ptr = str = (char *)xmalloc(bufsize);
+    cap = bufsize = (term.col + 1) * (sel.ne.y - sel.nb.y + 1) * UTF_SIZ;
+    ptr = str = (char *)xmalloc(cap);
 
     /* append every set & selected glyph to the selection */
     for (y = sel.nb.y; y <= sel.ne.y; y++)
@@ -534,15 +986,27 @@ TerminalEmulator::getsel(void)
             lastx = (sel.ne.y == y) ? sel.ne.x : term.col - 1;
         }
         last = &term.line[y][MIN(lastx, linelen - 1)];
-        while (last >= gp && last->u == ' ')
+        while (last >= gp && CELL_U(*last) == ' ')
             --last;
 
         for (; gp <= last; ++gp)
         {
-            if (gp->mode & ATTR_WDUMMY)
+            if (CELL_FLAGS(*gp) & ATTR_WDUMMY)
                 continue;
 
-            ptr += utf8encode(gp->u, ptr);
+            /* the size above only has room for one rune per cell */
+            if (CELL_FLAGS(*gp) & ATTR_CLUSTER)
+            {
+                bufsize += (CLUSTER_MAX - 1) * UTF_SIZ;
+                if (bufsize > cap)
+                {
+                    cap = MAX(bufsize, 2 * cap);
+                    off = ptr - str;
+                    str = (char *)xrealloc(str, cap);
+                    ptr = str + off;
+                }
+            }
+            ptr += cellencode(*gp, ptr);
         }
 
         /*
@@ -555,7 +1019,7 @@ TerminalEmulator::getsel(void)
 		 * FIXME: Fix the computer world.
 		 */
         if ((y < sel.ne.y || lastx >= linelen) &&
-            (!(last->mode & ATTR_WRAP) || sel.type == SEL_RECTANGULAR))
+            (!(CELL_FLAGS(*last) & ATTR_WRAP) || sel.type == SEL_RECTANGULAR))
             *ptr++ = '\n';
     }
     *ptr = 0;
@@ -662,11 +1126,21 @@ int TerminalEmulator::tattrset(int attr)
 {
     int i, j;
 
+    if (!(attr & ~TRACKED_ATTR))
+    {
+        for (i = 0; i < term.row; i++)
+        {
+            if (ATTRCNT(term.line[i]))
+                return 1;
+        }
+        return 0;
+    }
+
     for (i = 0; i < term.row - 1; i++)
     {
         for (j = 0; j < term.col - 1; j++)
         {
-            if (term.line[i][j].mode & attr)
+            if (CELL_MODE(term.line[i][j]) & attr)
                 return 1;
         }
     }
@@ -682,18 +1156,55 @@ void TerminalEmulator::tsetdirt(int top, int bot)
     LIMIT(bot, 0, term.row - 1);
 
     for (i = top; i <= bot; i++)
-        term.dirty[i] = 1;
+    {
+        term.dirty[i].x1 = 0;
+        term.dirty[i].x2 = term.col;
+    }
+}
+
+void TerminalEmulator::tsetdirtspan(int y, int x1, int x2)
+{
+    DirtySpan *d = &term.dirty[y];
+
+    d->x1 = MIN(d->x1, x1);
+    d->x2 = MAX(d->x2, x2);
+}
+
+/*
+ * Recounts the tracked attributes of a line after a bulk change. Callers
+ * skip lines whose count is already 0, a bulk change never adds any.
+ */
+void TerminalEmulator::tcountattr(int y)
+{
+    int x, n = 0;
+
+    for (x = 0; x < term.col; x++)
+    {
+        if (CELL_MODE(term.line[y][x]) & TRACKED_ATTR)
+            n++;
+    }
+    ATTRCNT(term.line[y]) = n;
 }
 
 void TerminalEmulator::tsetdirtattr(int attr)
 {
     int i, j;
 
+    if (!(attr & ~TRACKED_ATTR))
+    {
+        for (i = 0; i < term.row; i++)
+        {
+            if (ATTRCNT(term.line[i]))
+                tsetdirt(i, i);
+        }
+        return;
+    }
+
     for (i = 0; i < term.row - 1; i++)
     {
         for (j = 0; j < term.col - 1; j++)
         {
-            if (term.line[i][j].mode & attr)
+            if (CELL_MODE(term.line[i][j]) & attr)
             {
                 tsetdirt(i, i);
                 break;
@@ -709,17 +1220,16 @@ void TerminalEmulator::tfulldirt(void)
 
 void TerminalEmulator::tcursor(int mode)
 {
-    static TCursor c[2];
     int alt = IS_SET(MODE_ALTSCREEN);
 
     if (mode == CURSOR_SAVE)
     {
-        c[alt] = term.c;
+        term.saved[alt] = term.c;
     }
     else if (mode == CURSOR_LOAD)
     {
-        term.c = c[alt];
-        tmoveto(c[alt].x, c[alt].y);
+        term.c = term.saved[alt];
+        tmoveto(term.saved[alt].x, term.saved[alt].y);
     }
 }
 
@@ -727,6 +1237,10 @@ void TerminalEmulator::treset(void)
 {
     uint i;
 
+    /* as in xterm, a reset goes back to the primary screen */
+    if (IS_SET(MODE_ALTSCREEN))
+        tswapscreen();
+
     term.c = TCursor{};
     term.c.attr = Glyph{};
     term.c.attr.mode = ATTR_NULL;
@@ -749,8 +1263,18 @@ void TerminalEmulator::treset(void)
     {
         tmoveto(0, 0);
         tcursor(CURSOR_SAVE);
-        tclearregion(0, 0, term.col - 1, term.row - 1);
-        tswapscreen();
+        if (term.alt)
+        {
+            tclearregion(0, 0, term.col - 1, term.row - 1);
+            tswapscreen();
+        }
+        else
+        {
+            /* an alternate screen that does not exist only has a cursor */
+            if (i == 0)
+                tclearregion(0, 0, term.col - 1, term.row - 1);
+            term.mode ^= MODE_ALTSCREEN;
+        }
     }
 }
 
@@ -761,6 +1285,7 @@ void TerminalEmulator::tnew(int col, int row)
     term.c.attr = Glyph{};
     term.c.attr.fg = defaultfg;
     term.c.attr.bg = defaultbg;
+    term.hist.fd = -1;
 
     tresize(col, row);
     treset();
@@ -768,75 +1293,2557 @@ void TerminalEmulator::tnew(int col, int row)
 
 void TerminalEmulator::tswapscreen(void)
 {
-    Line *tmp = term.line;
+    CellLine *tmp;
+    ClusterPool pool;
+    Glyph attr;
+    int fresh = !term.alt;
+
+    if (fresh)
+        taltnew();
 
+    tmp = term.line;
     term.line = term.alt;
     term.alt = tmp;
+    tmp = term.ring;
+    term.ring = term.altring;
+    term.altring = tmp;
+    pool = term.clusters;
+    term.clusters = term.altclusters;
+    term.altclusters = pool;
     term.mode ^= MODE_ALTSCREEN;
+    if (!IS_SET(MODE_ALTSCREEN))
+        m_altLeft = std::chrono::steady_clock::now();
+
+    if (fresh)
+    {
+        /* blank as treset leaves it */
+        attr = term.c.attr;
+        term.c.attr.fg = defaultfg;
+        term.c.attr.bg = defaultbg;
+        tclearregion(0, 0, term.col - 1, term.row - 1);
+        term.c.attr = attr;
+    }
     tfulldirt();
 }
 
-void TerminalEmulator::tscrolldown(int orig, int n)
+/*
+ * The alternate screen is only allocated when it is first shown, with
+ * room for its rows added to the slab.
+ */
+void TerminalEmulator::taltnew(void)
 {
     int i;
-    Line temp;
 
-    LIMIT(n, 0, term.bot - orig + 1);
+    tlinearize();
+    term.altring = (CellLine *)xmalloc(2 * term.row * sizeof(CellLine));
+    term.alt = term.altring;
+    /* cleared by tswapscreen */
+    for (i = 0; i < term.row; i++)
+        term.alt[i] = term.blank;
+    tallocrows(term.col, term.row, term.row);
+    memcpy(term.ring + term.row, term.ring, term.row * sizeof(CellLine));
+    memcpy(term.altring + term.row, term.altring, term.row * sizeof(CellLine));
+}
 
-    tsetdirt(orig, term.bot - n);
-    tclearregion(0, term.bot - n + 1, term.col - 1, term.bot);
+/*
+ * Frees the alternate screen, which is blank while the primary one is
+ * shown, and shrinks the slab back to the rows of one screen.
+ */
+void TerminalEmulator::taltfree(void)
+{
+    tlinearize();
+    free(term.altring);
+    term.alt = term.altring = NULL;
+    free(term.altclusters.buf);
+    term.altclusters = ClusterPool{};
+    tnewslab(term.stride, MAX(term.row, term.slabrows / 2), term.row, term.col);
+    tallocrows(term.col, term.row, term.row);
+    memcpy(term.ring + term.row, term.ring, term.row * sizeof(CellLine));
+}
+
+/*
+ * The rows of a screen live in a ring of 2 * term.row pointers where the
+ * second half repeats the first, so term.line can start at any offset and
+ * still be indexed linearly. Scrolling the whole screen only moves that
+ * offset; partial regions swap rows and then copy them to their mirror.
+ */
+void TerminalEmulator::tmirror(int y1, int y2)
+{
+    int y, i;
 
-    for (i = term.bot; i >= orig + n; i--)
+    for (y = y1; y <= y2; y++)
     {
-        temp = term.line[i];
-        term.line[i] = term.line[i - n];
-        term.line[i - n] = temp;
+        i = term.line - term.ring + y;
+        term.ring[i < term.row ? i + term.row : i - term.row] = term.line[y];
     }
-
-    selscroll(orig, n);
 }
 
-void TerminalEmulator::tscrollup(int orig, int n)
+/* move both screens back to offset 0 of their rings */
+void TerminalEmulator::tlinearize(void)
 {
-    int i;
-    Line temp;
-
-    LIMIT(n, 0, term.bot - orig + 1);
-
-    tclearregion(0, orig, term.col - 1, orig + n - 1);
-    tsetdirt(orig + n, term.bot);
+    if (term.line != term.ring)
+        memmove(term.ring, term.line, term.row * sizeof(CellLine));
+    if (term.alt && term.alt != term.altring)
+        memmove(term.altring, term.alt, term.row * sizeof(CellLine));
+    term.line = term.ring;
+    term.alt = term.altring;
+}
 
-    for (i = orig; i <= term.bot - n; i++)
+/*
+ * Scrollback pages of every terminal kept in memory, oldest first. The bytes
+ * they take are capped by histmaxmem, past it the oldest ones are written to
+ * the spill file of their terminal or taken from it.
+ */
+static struct
+{
+    HistPage *oldest;
+    HistPage *newest;
+    HistPage *free;   /* raw pages given back by a terminal, reused first */
+    size_t siz;       /* bytes allocated, free pages included */
+    size_t pending;   /* bytes of the pages being written out */
+} histpool;
+
+/* scratch buffers of thpackpage and thunpack, kept between calls */
+static uchar *histbuf[3];
+static size_t histbufsiz[3];
+
+static uchar *
+histscratch(int i, size_t n)
+{
+    if (n > histbufsiz[i])
     {
-        temp = term.line[i];
-        term.line[i] = term.line[i + n];
-        term.line[i + n] = temp;
+        histbuf[i] = (uchar *)xrealloc(histbuf[i], n);
+        histbufsiz[i] = n;
     }
+    return histbuf[i];
+}
 
-    selscroll(orig, -n);
+/* takes p out of the pool list */
+static void
+histunlink(HistPage *p)
+{
+    if (p->prev)
+        p->prev->next = p->next;
+    else
+        histpool.oldest = p->next;
+    if (p->next)
+        p->next->prev = p->prev;
+    else
+        histpool.newest = p->prev;
 }
 
-void TerminalEmulator::selscroll(int orig, int n)
+#ifndef WIN32
+/*
+ * Writer of the spill files. Pages are handed to it by histspillpage and
+ * given back through done, so neither pushing nor reading lines waits on
+ * the disk. It is allocated with its thread once and both last until exit.
+ */
+typedef struct
 {
-    if (sel.ob.x == -1)
-        return;
+    std::mutex lock;
+    std::condition_variable cond;
+    HistPage *todo;   /* pages to write, or spilled pages to punch out */
+    HistPage **tail;
+    HistPage *done;   /* pages written, for histreap */
+    int busy;
+} HistWriter;
+
+static HistWriter *histio;
+
+/* an unlinked file in $TMPDIR, -2 if there is none */
+static int
+histopen(void)
+{
+    const char *dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/hexe-scrollback-XXXXXX", dir && *dir ? dir : "/tmp");
+    if ((fd = mkstemp(path)) < 0)
+        return -2;
+    unlink(path);
+    return fd;
+}
 
-    if (BETWEEN(sel.nb.y, orig, term.bot) != BETWEEN(sel.ne.y, orig, term.bot))
-    {
-        selclear();
-    }
-    else if (BETWEEN(sel.nb.y, orig, term.bot))
+static int
+histwrite(int fd, const uchar *s, size_t n, int64_t off)
+{
+    ssize_t r;
+
+    while (n > 0)
     {
-        sel.ob.y += n;
-        sel.oe.y += n;
-        if (sel.ob.y < term.top || sel.ob.y > term.bot ||
-            sel.oe.y < term.top || sel.oe.y > term.bot)
-        {
-            selclear();
-        }
-        else
+        if ((r = pwrite(fd, s, n, off)) < 0)
         {
-            selnormalize();
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        s += r;
+        n -= r;
+        off += r;
+    }
+    return 0;
+}
+
+static void
+histwriter(void)
+{
+    std::unique_lock<std::mutex> lk(histio->lock);
+    HistPage *p;
+    History *h;
+    int fd;
+
+    for (;;)
+    {
+        if (!(p = histio->todo))
+        {
+            histio->busy = 0;
+            histio->cond.notify_all();
+            histio->cond.wait(lk);
+            continue;
+        }
+        if (!(histio->todo = p->next))
+            histio->tail = &histio->todo;
+        histio->busy = 1;
+
+        /* the owner of a page dropped while queued is gone */
+        if ((h = p->owner) && h->fd == -1)
+        {
+            lk.unlock();
+            fd = histopen();
+            lk.lock();
+            h->fd = fd;
+        }
+        fd = h ? h->fd : -2;
+        lk.unlock();
+
+        if (p->state == HIST_DISK)
+        {
+#ifdef FALLOC_FL_PUNCH_HOLE
+            if (fd >= 0)
+                fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, p->off, p->packed);
+#endif
+            free(p);
+            lk.lock();
+            continue;
+        }
+        if (fd < 0 || histwrite(fd, (const uchar *)(p + 1), p->packed, p->off) < 0)
+            p->off = -1;
+
+        lk.lock();
+        p->next = histio->done;
+        histio->done = p;
+        histio->cond.notify_all();
+    }
+}
+
+/* frees the pages written out, their headers now read from the file */
+static void
+histreap(void)
+{
+    HistPage *p, *q;
+
+    if (!histio)
+        return;
+
+    std::lock_guard<std::mutex> lk(histio->lock);
+    for (p = histio->done; p; p = q)
+    {
+        q = p->next;
+        if (p->prev)
+        {
+            p->prev->state = HIST_DISK;
+            p->prev->off = p->off;
+            p->prev->next = NULL;
+        }
+        histpool.pending -= HISTSIZ(p);
+        free(p);
+    }
+    histio->done = NULL;
+}
+
+/*
+ * Waits for the writer to write a page out and frees it. Returns 0 if it
+ * has none left to write.
+ */
+static int
+histwait(void)
+{
+    if (!histio)
+        return 0;
+    {
+        std::unique_lock<std::mutex> lk(histio->lock);
+        while (!histio->done && (histio->todo || histio->busy))
+            histio->cond.wait(lk);
+        if (!histio->done)
+            return 0;
+    }
+    histreap();
+    return 1;
+}
+
+/*
+ * Hands the oldest packed page in memory that is the oldest of its terminal
+ * in memory to the writer. A header takes its place in the terminal and is
+ * read from it until it is written. Returns 0 if there is none to spill.
+ */
+static int
+histspillpage(void)
+{
+    History *h;
+    HistPage *p, *q;
+
+    if (!histspill)
+        return 0;
+    /* past a backlog of a quarter of histmaxmem, histalloc waits for the writer */
+    if (histpool.pending > histmaxmem / 4)
+        histreap();
+    if (histpool.pending > histmaxmem / 4)
+        return 0;
+    /* raw pages are the newest of a terminal, only a few are passed */
+    for (p = histpool.oldest; p; p = p->next)
+    {
+        if (p->packed && HISTPAGE(p->owner, p->owner->nspill) == p)
+            break;
+    }
+    if (!p)
+        return 0;
+    h = p->owner;
+    if (!histio)
+    {
+        histio = new HistWriter();
+        histio->tail = &histio->todo;
+        std::thread(histwriter).detach();
+    }
+
+    std::lock_guard<std::mutex> lk(histio->lock);
+    if (h->fd == -2)
+        return 0;
+
+    q = (HistPage *)xmalloc(sizeof(HistPage));
+    *q = *p;
+    q->prev = NULL;
+    q->next = p;
+    q->state = HIST_WRITING;
+    q->off = h->spillend;
+    h->spillend += p->packed;
+    HISTPAGE(h, h->nspill) = q;
+    h->nspill++;
+    if (h->unpacked == p)
+        h->unpacked = q;
+
+    histunlink(p);
+    histpool.siz -= HISTSIZ(p);
+    histpool.pending += HISTSIZ(p);
+    p->prev = q;
+    p->next = NULL;
+    p->state = HIST_WRITING;
+    p->off = q->off;
+    *histio->tail = p;
+    histio->tail = &p->next;
+    histio->cond.notify_all();
+    return 1;
+}
+
+/* frees the header of a dropped page that was spilled */
+static void
+histunspill(HistPage *p)
+{
+    if (p->state == HIST_WRITING)
+    {
+        /* the writer still has the page, histreap frees it */
+        std::lock_guard<std::mutex> lk(histio->lock);
+        p->next->owner = NULL;
+        p->next->prev = NULL;
+    }
+    else if (p->off >= 0)
+    {
+        /* the writer gives the blocks of the page back, then frees it */
+        std::lock_guard<std::mutex> lk(histio->lock);
+        p->next = NULL;
+        *histio->tail = p;
+        histio->tail = &p->next;
+        histio->cond.notify_all();
+        return;
+    }
+    free(p);
+}
+
+/* the compressed lines of a page written out, NULL if they cannot be read */
+static const uchar *
+histmap(History *h, const HistPage *p)
+{
+    int64_t base;
+    size_t siz;
+    void *map;
+
+    if (p->off < 0)
+        return NULL;
+    base = p->off & ~(int64_t)(HIST_MAP_SIZ - 1);
+    siz = (p->off - base + p->packed + HIST_MAP_SIZ - 1) & ~(size_t)(HIST_MAP_SIZ - 1);
+    if (!h->map || base != h->mapoff || siz > h->mapsiz)
+    {
+        if (h->map)
+            munmap(h->map, h->mapsiz);
+        h->map = NULL;
+        if ((map = mmap(NULL, siz, PROT_READ, MAP_SHARED, h->fd, base)) == MAP_FAILED)
+            return NULL;
+        h->map = (uchar *)map;
+        h->mapoff = base;
+        h->mapsiz = siz;
+    }
+    return h->map + (p->off - base);
+}
+
+/* waits for the writer to be done with the pages of h, then closes its file */
+static void
+histclose(History *h)
+{
+    if (histio)
+    {
+        std::unique_lock<std::mutex> lk(histio->lock);
+        while (histio->todo || histio->busy)
+            histio->cond.wait(lk);
+    }
+    if (h->map)
+        munmap(h->map, h->mapsiz);
+    if (h->fd >= 0)
+        close(h->fd);
+    h->map = NULL;
+    h->fd = -1;
+}
+#else
+/* pages are not spilled, past histmaxmem they are dropped */
+static int histspillpage(void) { return 0; }
+static int histwait(void) { return 0; }
+static void histreap(void) {}
+static void histunspill(HistPage *p) { free(p); }
+static const uchar *histmap(History *, const HistPage *) { return NULL; }
+static void histclose(History *) {}
+#endif
+
+/* takes the oldest page out of h and of the pool list */
+static HistPage *
+histdrop(History *h)
+{
+    HistPage *p = h->pages[h->head];
+
+    h->nline -= p->nline - h->first;
+    h->nrows -= p->rows;
+    h->first = 0;
+    h->head = (h->head + 1) & (h->siz - 1);
+    h->npage--;
+    if (h->counted)
+        h->counted--;
+    if (h->unpacked == p)
+        h->unpacked = NULL;
+
+    if (p->state != HIST_MEM)
+        h->nspill--;
+    else
+        histunlink(p);
+    return p;
+}
+
+/* frees a page that was dropped, one raw page is kept for reuse */
+static void
+histfree(HistPage *p)
+{
+    if (p->state != HIST_MEM)
+    {
+        histunspill(p);
+    }
+    else if (p->packed || histpool.free)
+    {
+        histpool.siz -= HISTSIZ(p);
+        free(p);
+    }
+    else
+    {
+        p->next = NULL;
+        histpool.free = p;
+    }
+}
+
+/* whether a new page goes past histmaxmem, the free page being counted already */
+static int
+histfull(void)
+{
+    return histpool.siz + (histpool.free ? 0 : HIST_PAGE_SIZ) > histmaxmem;
+}
+
+/*
+ * Whether dropping the oldest page of h gives memory back: it is in memory,
+ * or was lost on its way to a spill file that could not be written.
+ */
+static int
+histcandrop(const History *h)
+{
+    const HistPage *p = h->pages[h->head];
+
+    return p->state == HIST_MEM || (p->state == HIST_DISK && p->off < 0);
+}
+
+/*
+ * An empty raw page for h, NULL if histmaxmem has no room for one. Pages
+ * written out are never dropped to make room, they take no memory. If no
+ * page in memory can be spilled or dropped, histmaxmem is overrun.
+ */
+static HistPage *
+histalloc(History *h)
+{
+    HistPage *p, *q;
+
+    /* the oldest pages of any terminal are written out or go until a new one fits */
+    while (histfull() && histpool.oldest)
+    {
+        if (histspillpage() || histwait())
+            continue;
+        for (q = histpool.oldest; q && !histcandrop(q->owner); q = q->next)
+            /* nothing */;
+        if (!q)
+            break;
+        histfree(histdrop(q->owner));
+    }
+    if ((p = histpool.free))
+    {
+        histpool.free = p->next;
+    }
+    else
+    {
+        if (histpool.siz + HIST_PAGE_SIZ > histmaxmem && !histpool.oldest)
+            return NULL;
+        p = (HistPage *)xmalloc(HIST_PAGE_SIZ);
+        histpool.siz += HIST_PAGE_SIZ;
+    }
+
+    p->owner = h;
+    p->start = h->npushed;
+    p->nline = 0;
+    p->rows = 0;
+    p->ncell = 0;
+    p->packed = 0;
+    p->state = HIST_MEM;
+    p->off = -1;
+    p->next = NULL;
+    p->prev = histpool.newest;
+    if (histpool.newest)
+        histpool.newest->next = p;
+    else
+        histpool.oldest = p;
+    histpool.newest = p;
+    return p;
+}
+
+/* the layout flags of a cell of a raw page or of the cache */
+static inline ushort
+histflags(const Glyph &g)
+{
+    return g.mode;
+}
+
+#ifdef HEXE_COMPACT_CELLS
+static inline ushort
+histflags(const Cell &c)
+{
+    return CELL_FLAGS(c);
+}
+#endif
+
+/*
+ * Cells of the row that starts at c, len cells before the end of its line,
+ * when wrapped at col. A wide char that would be cut goes to the next row.
+ */
+template <typename T>
+static inline int
+histrow(const T *c, int len, int col)
+{
+    if (len <= col)
+        return len;
+    return col > 1 && histflags(c[col - 1]) & ATTR_WIDE ? col - 1 : col;
+}
+
+/* rows of the len cells at c from the one at *off, which is left at the last */
+template <typename T>
+static int
+histwalk(const T *c, int len, int col, int *off)
+{
+    int n;
+
+    for (n = 1; len - *off > col; n++)
+        *off += histrow(c + *off, len - *off, col);
+    return n;
+}
+
+/* rows of lines i to n of a page whose lines end at end in c */
+template <typename T>
+static int
+histcount(const T *c, const ushort *end, int i, int n, int col)
+{
+    int rows, s, off;
+
+    for (rows = 0; i < n; i++)
+    {
+        s = i ? end[i - 1] : 0;
+        off = 0;
+        rows += histwalk(c + s, end[i] - s, col, &off);
+    }
+    return rows;
+}
+
+/*
+ * First cell of row r of lines i to n of a page, -1 past them. Sets len to
+ * the cells of the row and wrap if its line goes on in the next one.
+ */
+template <typename T>
+static int
+histfind(const T *c, const ushort *end, int i, int n, int col, int r, int *len, int *wrap)
+{
+    int s, k, off, siz;
+
+    for (; i < n; i++)
+    {
+        s = i ? end[i - 1] : 0;
+        siz = end[i] - s;
+        for (off = 0;; off += k)
+        {
+            k = histrow(c + s + off, siz - off, col);
+            if (!r--)
+            {
+                *len = k;
+                *wrap = off + k < siz;
+                return s + off;
+            }
+            if (off + k >= siz)
+                break;
+        }
+    }
+    return -1;
+}
+
+/* rows of a page that was not counted, its lines ending half way through a row */
+static int
+histguess(const HistPage *p, int col)
+{
+    return MAX(p->nline, (p->packed ? p->ncell : HISTSTART(p, p->nline)) / col + p->nline / 2);
+}
+
+/* whether the newest line of h was soft wrapped, and goes on with the next row */
+static int
+histwrapped(const History *h)
+{
+    const HistPage *p;
+    int end;
+
+    if (!h->npage)
+        return 0;
+    p = HISTPAGE(h, h->npage - 1);
+    end = HISTSTART(p, p->nline);
+    return end > HISTSTART(p, p->nline - 1) && CELL_FLAGS(HISTCELLS(p)[end - 1]) & ATTR_WRAP;
+}
+
+/*
+ * Copies the top n lines of the screen to the scrollback, without their
+ * trailing default blanks. Lines are packed into pages, nothing is
+ * allocated per line. A row that was soft wrapped is joined to the line
+ * before it, so the scrollback can be wrapped again at another width.
+ */
+void TerminalEmulator::thpush(int n)
+{
+    History *h = &term.hist;
+    HistPage *p, *q;
+    CellLine line;
+    Cell blank, *c;
+    Glyph g;
+    int y, i, len, siz, start, end, rows, append, carry;
+
+    if (histsize <= 0)
+        return;
+
+    g.u = ' ';
+    g.mode = ATTR_NULL;
+    g.fg = defaultfg;
+    g.bg = defaultbg;
+    CELL_SET(blank, ' ', &g, CELL_STYLE(&g));
+
+    for (y = 0; y < n; y++)
+    {
+        line = term.line[y];
+        len = celltrim(line, blank, MIN(term.col, HIST_PAGE_CELLS));
+
+        p = h->npage ? HISTPAGE(h, h->npage - 1) : NULL;
+        append = carry = 0;
+        if (histwrapped(h))
+        {
+            c = HISTCELLS(p);
+            i = p->nline - 1;
+            start = HISTSTART(p, i);
+            end = HISTOFF(p)[i];
+            CELL_CLRFLAG(c[end - 1], ATTR_WRAP);
+
+            /* the blank left before a wide char that did not fit is padding */
+            if (len && CELL_FLAGS(line[0]) & ATTR_WIDE && end - 1 > start &&
+                CELL_RAW(c[end - 1]) == ' ' && !(CELL_FLAGS(c[end - 1]) & ATTR_CLUSTER))
+            {
+                if (end - 1 <= start + h->lastoff)
+                {
+                    rows = -histcount(c, HISTOFF(p), i, i + 1, h->cols);
+                    h->lastoff = 0;
+                    rows += histwalk(c + start, end - 1 - start, h->cols, &h->lastoff);
+                    p->rows += rows;
+                    h->nrows += rows;
+                    h->npushed += rows;
+                }
+                HISTOFF(p)[i] = --end;
+            }
+
+            /* a line that does not fit goes to the next page, unless it fills it */
+            if (end + len <= HIST_PAGE_CELLS)
+                append = 1;
+            else if (i > (h->npage == 1 ? h->first : 0) && end - start + len <= HIST_PAGE_CELLS)
+                carry = end - start;
+        }
+
+        /* past the cap the oldest line goes, its page once it is empty */
+        if (!append && !carry && h->nline >= histsize)
+        {
+            q = h->pages[h->head];
+            h->first++;
+            h->nline--;
+            if (h->first == q->nline)
+            {
+                histfree(histdrop(h));
+            }
+            else if (!h->counted)
+            {
+                /* the oldest page stays counted while its line is at hand */
+                if (!q->packed)
+                {
+                    rows = histcount(HISTCELLS(q), HISTOFF(q), h->first - 1, h->first, h->cols);
+                }
+                else if (h->unpacked == q)
+                {
+                    rows = histcount(h->cache, h->cacheoff, h->first - 1, h->first, h->cols);
+                }
+                else
+                {
+                    rows = q->rows - histguess(q, h->cols);
+                    h->counted = 1;
+                }
+                q->rows -= rows;
+                q->start += rows;
+                h->nrows -= rows;
+            }
+            p = h->npage ? HISTPAGE(h, h->npage - 1) : NULL;
+        }
+
+        if (!append && (carry || !p || p->nline == HIST_PAGE_LINES || HISTSTART(p, p->nline) + len > HIST_PAGE_CELLS))
+        {
+            q = p;
+            /* cold pages are packed early rather than evicted */
+            if (histfull())
+                thpack();
+            if (!(p = histalloc(h)))
+                return;
+            /* making room may have taken the page of the line */
+            if (p == q || !h->npage || HISTPAGE(h, h->npage - 1) != q)
+                carry = 0;
+            if (h->npage == h->siz)
+            {
+                siz = MAX(2 * h->siz, 16);
+                h->pages = (HistPage **)xrealloc(h->pages, siz * sizeof(HistPage *));
+                /* the slots before head move past the old end */
+                if (h->head)
+                    memcpy(h->pages + h->siz, h->pages, h->head * sizeof(HistPage *));
+                h->siz = siz;
+            }
+            HISTPAGE(h, h->npage) = p;
+            h->npage++;
+
+            /* the line takes its rows along */
+            if (carry)
+            {
+                i = q->nline - 1;
+                rows = histcount(HISTCELLS(q), HISTOFF(q), i, i + 1, h->cols);
+                memcpy(HISTCELLS(p), HISTCELLS(q) + HISTSTART(q, i), carry * sizeof(Cell));
+                HISTOFF(p)[0] = carry;
+                p->nline = 1;
+                p->rows = rows;
+                p->start -= rows;
+                q->nline--;
+                q->rows -= rows;
+                append = 1;
+            }
+        }
+
+        end = HISTSTART(p, p->nline);
+        memcpy(HISTCELLS(p) + end, line, len * sizeof(Cell));
+        if (append)
+        {
+            start = HISTSTART(p, p->nline - 1);
+            HISTOFF(p)[p->nline - 1] = end + len;
+            rows = histwalk(HISTCELLS(p) + start, end + len - start, h->cols, &h->lastoff) - 1;
+        }
+        else
+        {
+            HISTOFF(p)[p->nline++] = end + len;
+            h->nline++;
+            h->lastoff = 0;
+            rows = histwalk(HISTCELLS(p) + end, len, h->cols, &h->lastoff);
+        }
+        p->rows += rows;
+        h->nrows += rows;
+        h->npushed += rows;
+    }
+}
+
+/* gives the pages of the scrollback back to the system */
+void TerminalEmulator::thclear(void)
+{
+    History *h = &term.hist;
+    HistPage *p;
+
+    while (h->npage)
+    {
+        p = histdrop(h);
+        if (p->packed)
+        {
+            histfree(p);
+        }
+        else
+        {
+            histpool.siz -= HIST_PAGE_SIZ;
+            free(p);
+        }
+    }
+    h->first = 0;
+    h->nrows = 0;
+    h->counted = 0;
+    h->lastoff = 0;
+
+    free(h->cache);
+    free(h->cacheoff);
+    free(h->marks);
+    h->cache = NULL;
+    h->cacheoff = NULL;
+    h->marks = NULL;
+    h->nmarks = h->marksiz = 0;
+}
+
+/*
+ * Rows are counted again at col, exactly for the newest page, which is raw
+ * and where lines are pushed, and estimated for the others until thline
+ * gets to them.
+ */
+void TerminalEmulator::thresize(int col)
+{
+    History *h = &term.hist;
+    HistPage *p;
+    int k, i;
+
+    /* the rows of the matches found so far are gone */
+    SearchCancel();
+
+    h->cols = col;
+    h->nrows = 0;
+    h->lastoff = 0;
+    h->counted = MAX(h->npage - 1, 0);
+    for (k = 0; k < h->npage; k++)
+    {
+        p = HISTPAGE(h, k);
+        if (k < h->npage - 1)
+        {
+            p->rows = histguess(p, col);
+        }
+        else
+        {
+            p->rows = histcount(HISTCELLS(p), HISTOFF(p), k ? 0 : h->first, p->nline, col);
+            p->start = h->npushed - p->rows;
+            i = p->nline - 1;
+            histwalk(HISTCELLS(p) + HISTSTART(p, i), HISTOFF(p)[i] - HISTSTART(p, i), col, &h->lastoff);
+        }
+        h->nrows += p->rows;
+    }
+}
+
+/* counts the rows of page k, the one before the oldest counted */
+void TerminalEmulator::thcount(int k)
+{
+    History *h = &term.hist;
+    HistPage *p = HISTPAGE(h, k);
+    int rows, i = k ? 0 : h->first;
+
+    if (!p->packed)
+    {
+        rows = histcount(HISTCELLS(p), HISTOFF(p), i, p->nline, h->cols);
+    }
+    else
+    {
+        if (h->unpacked != p)
+            thunpack(p);
+        rows = histcount(h->cache, h->cacheoff, i, p->nline, h->cols);
+    }
+    h->nrows += rows - p->rows;
+    p->rows = rows;
+    p->start = HISTPAGE(h, k + 1)->start - rows;
+    h->counted = k;
+}
+
+/*
+ * Page of the scrollback holding the row pushed when npushed was t, -1 if
+ * it is not kept. The pages up to it are counted first.
+ */
+int TerminalEmulator::thpage(uint t)
+{
+    History *h = &term.hist;
+    int k, lo, hi;
+    uint base;
+
+    if (!h->npage || (int)(h->npushed - t) <= 0)
+        return -1;
+    while (h->counted > 0 && (int)(t - HISTPAGE(h, h->counted)->start) < 0)
+        thcount(h->counted - 1);
+
+    /* by the npushed of the first row of each */
+    base = HISTPAGE(h, h->counted)->start;
+    if ((int)(t - base) < 0)
+        return -1;
+    t -= base;
+    for (lo = h->counted, hi = h->npage - 1; lo < hi;)
+    {
+        k = (lo + hi + 1) / 2;
+        if (HISTPAGE(h, k)->start - base <= t)
+            lo = k;
+        else
+            hi = k - 1;
+    }
+    return lo;
+}
+
+/*
+ * Expands the n-th row above the screen into at most term.col glyphs of
+ * dst and returns its length, 0 if there is no such row. Lines are wrapped
+ * at term.col, the pages up to the row are counted first. The clusters of
+ * a packed line are copied into the pool for the display.
+ */
+int TerminalEmulator::thline(int n, Glyph *dst)
+{
+    History *h = &term.hist;
+    HistPage *p;
+    const Glyph *src;
+    int k, i, x, len, wrap, need;
+    uint t;
+
+    if (n <= 0 || n > h->nrows)
+        return 0;
+
+    t = h->npushed - n;
+    if ((k = thpage(t)) < 0)
+        return 0;
+    p = HISTPAGE(h, k);
+    n = t - p->start;
+    i = k ? 0 : h->first;
+
+    if (!p->packed)
+    {
+        if ((x = histfind(HISTCELLS(p), HISTOFF(p), i, p->nline, h->cols, n, &len, &wrap)) < 0)
+            return 0;
+        for (k = 0; k < len; k++)
+            dst[k] = CELL_GLYPH(HISTCELLS(p)[x + k]);
+        if (wrap)
+            dst[len - 1].mode |= ATTR_WRAP;
+        return len;
+    }
+
+    if (h->unpacked != p)
+        thunpack(p);
+    if ((x = histfind(h->cache, h->cacheoff, i, p->nline, h->cols, n, &len, &wrap)) < 0)
+        return 0;
+    src = h->cache + x;
+
+    /* one allocation for the line, so a collection cannot move its clusters */
+    for (x = need = 0; x < len; x++)
+    {
+        if (src[x].mode & ATTR_CLUSTER)
+            need += h->marks[src[x].u] + 1;
+    }
+    k = need && !IS_SET(MODE_ALTSCREEN) ? tclusteralloc(need) : -1;
+
+    for (x = 0; x < len; x++)
+    {
+        dst[x] = src[x];
+        if (!(src[x].mode & ATTR_CLUSTER))
+            continue;
+        n = h->marks[src[x].u] + 1;
+        if (k < 0)
+        {
+            /* the marks are dropped if the pool is full */
+            dst[x].u = h->marks[src[x].u + 1];
+            dst[x].mode &= ~ATTR_CLUSTER;
+            continue;
+        }
+        memcpy(&term.clusters.buf[k], &h->marks[src[x].u], n * sizeof(Rune));
+        dst[x].u = k;
+        k += n;
+    }
+    if (wrap)
+        dst[len - 1].mode |= ATTR_WRAP;
+    return len;
+}
+
+static uchar *
+putvar(uchar *s, uint32_t v)
+{
+    for (; v >= 0x80; v >>= 7)
+        *s++ = (uchar)(v | 0x80);
+    *s++ = (uchar)v;
+    return s;
+}
+
+static uint32_t
+getvar(const uchar **s)
+{
+    uint32_t v = 0;
+    int shift = 0;
+
+    do
+    {
+        v |= (uint32_t)(**s & 0x7F) << shift;
+        shift += 7;
+    } while (*(*s)++ & 0x80 && shift < 35);
+    return v;
+}
+
+/*
+ * Packs the raw pages past the newest histhot lines of the scrollback. If a
+ * new page still does not fit in histmaxmem once the cold pages are written
+ * out, the newer ones are packed too, oldest first, so that they can be
+ * spilled rather than dropped.
+ */
+void TerminalEmulator::thpack(void)
+{
+    History *h = &term.hist;
+    int k, n;
+
+    histreap();
+    if (!h->npage)
+        return;
+
+    /* the page lines are pushed into stays raw */
+    k = h->npage - 1;
+    for (n = HISTPAGE(h, k)->nline, k--; k >= 0 && n < histhot; k--)
+        n += HISTPAGE(h, k)->nline;
+    for (; k >= 0 && !HISTPAGE(h, k)->packed; k--)
+        thpackpage(k);
+
+    while (histfull() && histspillpage())
+        /* nothing */;
+    for (k = 0; k < h->npage - 1 && histfull(); k++)
+    {
+        if (!HISTPAGE(h, k)->packed)
+            thpackpage(k);
+    }
+}
+
+/*
+ * Replaces page k of the scrollback with a packed copy: the length of each
+ * line, the runs of cells with the same attributes, then the runes, all
+ * compressed with lzpack. A packed page does not depend on the style table
+ * or the cluster pool.
+ */
+void TerminalEmulator::thpackpage(int k)
+{
+    History *h = &term.hist;
+    HistPage *p = HISTPAGE(h, k), *q;
+    const ClusterPool *pool = IS_SET(MODE_ALTSCREEN) ? &term.altclusters : &term.clusters;
+    const Cell *c = HISTCELLS(p);
+    const Rune *r;
+    Glyph run;
+    uchar *buf, *runes, *s, *t, *out;
+    int i, j, n, m, ncell = HISTSTART(p, p->nline);
+    size_t len;
+
+    /* lengths and runs take at most 5 and 20 bytes, runes 5 */
+    buf = s = histscratch(0, 5 + 5 * (size_t)p->nline + 25 * (size_t)ncell);
+    runes = t = histscratch(2, 5 * (size_t)ncell);
+
+    for (i = 0; i < p->nline; i++)
+        s = putvar(s, HISTOFF(p)[i] - HISTSTART(p, i));
+
+    /* the runes go to their own buffer in the same pass over the cells */
+    for (i = 0; i < ncell; i = j)
+    {
+        for (j = i + 1; j < ncell && CELL_ATTREQ(c[j], c[i]); j++)
+            /* nothing */;
+        run = CELL_GLYPH(c[i]);
+        s = putvar(s, j - i);
+        s = putvar(s, run.mode);
+        s = putvar(s, run.fg);
+        s = putvar(s, run.bg);
+
+        if (!(run.mode & ATTR_CLUSTER))
+        {
+            for (n = i; n < j; n++)
+                t = putvar(t, CELL_RAW(c[n]));
+            continue;
+        }
+        len = t - runes;
+        runes = histscratch(2, len + 5 * (size_t)(ncell - i) * (CLUSTER_MAX + 1));
+        t = runes + len;
+        for (n = i; n < j; n++)
+        {
+            r = &pool->buf[CELL_RAW(c[n])];
+            for (m = 0; m <= (int)r[0]; m++)
+                t = putvar(t, r[m]);
+        }
+    }
+
+    len = s - buf;
+    buf = histscratch(0, len + (t - runes));
+    memcpy(buf + len, runes, t - runes);
+    s = buf + len + (t - runes);
+
+    len = s - buf;
+    out = histscratch(1, 5 + len + len / 255 + 16);
+    s = putvar(out, (uint32_t)len);
+    s += lzpack(buf, len, s);
+    len = s - out;
+
+    q = (HistPage *)xmalloc(sizeof(HistPage) + len);
+    *q = *p;
+    q->ncell = ncell;
+    q->packed = (int)len;
+    memcpy(q + 1, out, len);
+
+    if (q->prev)
+        q->prev->next = q;
+    else
+        histpool.oldest = q;
+    if (q->next)
+        q->next->prev = q;
+    else
+        histpool.newest = q;
+    HISTPAGE(h, k) = q;
+    histpool.siz += HISTSIZ(q);
+
+    /* one raw page is kept for the next push, it is still warm */
+    if (histpool.free)
+    {
+        histpool.siz -= HIST_PAGE_SIZ;
+        free(p);
+    }
+    else
+    {
+        p->next = NULL;
+        histpool.free = p;
+    }
+}
+
+/* expands a packed page into the cache of the scrollback */
+void TerminalEmulator::thunpack(HistPage *p)
+{
+    History *h = &term.hist;
+    const uchar *data, *s, *end;
+    uchar *buf;
+    Glyph g;
+    uint32_t len, cnt;
+    int i, j, n, ncell;
+
+    if (!h->cache)
+    {
+        h->cache = (Glyph *)xmalloc(HIST_PAGE_CELLS * sizeof(Glyph));
+        h->cacheoff = (ushort *)xmalloc(HIST_PAGE_LINES * sizeof(ushort));
+    }
+
+    if (p->state == HIST_MEM)
+        data = (const uchar *)(p + 1);
+    else if (p->state == HIST_WRITING)
+        data = (const uchar *)(p->next + 1);
+    else
+        data = histmap(h, p);
+
+    /* a page that cannot be read or unpacked shows as empty lines */
+    s = data;
+    len = s ? getvar(&s) : 0;
+    buf = histscratch(0, len);
+    if (lzunpack(s, data ? p->packed - (s - data) : 0, buf, len) != (long)len)
+        memset(buf, 0, len);
+    s = buf;
+    end = buf + len;
+
+    for (i = ncell = 0; i < p->nline; i++)
+    {
+        ncell += s < end ? getvar(&s) : 0;
+        h->cacheoff[i] = ncell;
+    }
+
+    g.u = ' ';
+    for (i = 0; i < ncell && s < end; i += cnt)
+    {
+        cnt = getvar(&s);
+        cnt = MIN(cnt, (uint32_t)(ncell - i));
+        g.mode = getvar(&s);
+        g.fg = getvar(&s);
+        g.bg = getvar(&s);
+        for (j = 0; j < (int)cnt; j++)
+            h->cache[i + j] = g;
+    }
+
+    h->nmarks = 0;
+    for (i = 0; i < ncell && s < end; i++)
+    {
+        if (!(h->cache[i].mode & ATTR_CLUSTER))
+        {
+            h->cache[i].u = getvar(&s);
+            continue;
+        }
+        cnt = getvar(&s);
+        n = MIN(cnt, (uint32_t)CLUSTER_MAX);
+        if (h->nmarks + n + 1 > h->marksiz)
+        {
+            h->marksiz = MAX(2 * h->marksiz, h->nmarks + n + 1);
+            h->marks = (Rune *)xrealloc(h->marks, h->marksiz * sizeof(Rune));
+        }
+        h->cache[i].u = h->nmarks;
+        h->marks[h->nmarks++] = n;
+        for (j = 0; j < n; j++)
+            h->marks[h->nmarks++] = getvar(&s);
+    }
+    h->unpacked = p;
+}
+
+/*
+ * Search patterns are compiled into a program for a Pike VM over the runes
+ * of a line. Every thread moves one rune at a time, so a line is read once
+ * whatever the pattern, and nothing recurses on the text. Supported are
+ * . [] ^ $ | (), * + ? {n,m} and their lazy forms, \d \w \s and their
+ * negations, \b and \B. ^ and $ match at the ends of a line.
+ */
+enum rx_op
+{
+    RX_CHAR,   /* x is the rune */
+    RX_ANY,
+    RX_CLASS,  /* y ranges from range x */
+    RX_NCLASS,
+    RX_BOL,
+    RX_EOL,
+    RX_WORDB,
+    RX_NWORDB,
+    RX_SPLIT,  /* to x first, then y */
+    RX_JMP,    /* to x */
+    RX_MATCH,
+    RX_CAT,    /* nodes of the parse only */
+    RX_ALT,
+    RX_REP
+};
+
+typedef struct
+{
+    uchar op;
+    int x;
+    int y;
+} RxInst;
+
+/* A node of a parsed pattern, its children chained by next */
+typedef struct
+{
+    uchar type;   /* an rx_op */
+    uchar greedy;
+    int x;
+    int y;
+    int min;      /* of a repeat, max is -1 if unbounded */
+    int max;
+    int kid;
+    int next;
+} RxNode;
+
+typedef struct
+{
+    int pc;
+    int start; /* rune the match of the thread starts at */
+} RxThread;
+
+struct Hexe::Terminal::Regex
+{
+    RxInst *prog;
+    int len;
+    int siz;
+    RxNode *node;
+    int nnode;
+    int nodesiz;
+    Rune *range;   /* the first and last rune of each range of the classes */
+    int nrange;
+    int rangesiz;
+    int icase;     /* the text is folded to lower case, the pattern too */
+    Rune lit[RX_LIT_MAX]; /* runes every match has in a row */
+    int nlit;
+    int scan;      /* the one of them the prefilter looks for, -1 if none */
+    Rune sa;       /* and its cases */
+    Rune sb;
+    uchar first[256 / 8]; /* runes below 256 a match can start with */
+    int high;             /* whether it can start with the others */
+    RxThread *clist;
+    RxThread *nlist;
+    uint *mark;    /* generation each instruction was last added at */
+    uint gen;
+    int *stack;
+    /* parser */
+    const Rune *pat;
+    int pos;
+    int plen;
+    int flags;
+    int depth;
+    int err;
+};
+
+#define RX_ISWORD(u) (BETWEEN(u, '0', '9') || BETWEEN(u, 'A', 'Z') || BETWEEN(u, 'a', 'z') || (u) == '_')
+#define RX_FIRST(r, u) ((u) < 256 ? (r)->first[(u) >> 3] & 1 << ((u)&7) : (r)->high)
+
+static Rune
+rxlower(Rune u)
+{
+    if (u < 0x80)
+        return BETWEEN(u, 'A', 'Z') ? u + 'a' - 'A' : u;
+#ifdef WIN32
+    if (u > 0xFFFF)
+        return u;
+#endif
+    return (Rune)towlower((wint_t)u);
+}
+
+static Rune
+rxupper(Rune u)
+{
+    if (u < 0x80)
+        return BETWEEN(u, 'a', 'z') ? u - 'a' + 'A' : u;
+#ifdef WIN32
+    if (u > 0xFFFF)
+        return u;
+#endif
+    return (Rune)towupper((wint_t)u);
+}
+
+static int
+rxnew(Regex *r, int type, int x, int y)
+{
+    RxNode *n;
+
+    if (r->nnode == r->nodesiz)
+    {
+        r->nodesiz = MAX(2 * r->nodesiz, 64);
+        r->node = (RxNode *)xrealloc(r->node, r->nodesiz * sizeof(RxNode));
+    }
+    n = &r->node[r->nnode];
+    n->type = type;
+    n->greedy = 1;
+    n->x = x;
+    n->y = y;
+    n->min = n->max = 0;
+    n->kid = n->next = -1;
+    return r->nnode++;
+}
+
+static void
+rxrange(Regex *r, Rune lo, Rune hi)
+{
+    if (r->nrange == r->rangesiz)
+    {
+        r->rangesiz = MAX(2 * r->rangesiz, 16);
+        r->range = (Rune *)xrealloc(r->range, 2 * r->rangesiz * sizeof(Rune));
+    }
+    r->range[2 * r->nrange] = lo;
+    r->range[2 * r->nrange + 1] = hi;
+    r->nrange++;
+}
+
+/* adds the ranges of the class escaped by c, 0 if it does not name one */
+static int
+rxclassesc(Regex *r, Rune c)
+{
+    switch (c)
+    {
+    case 'd':
+        rxrange(r, '0', '9');
+        return 1;
+    case 'w':
+        rxrange(r, '0', '9');
+        rxrange(r, 'A', 'Z');
+        rxrange(r, '_', '_');
+        rxrange(r, 'a', 'z');
+        return 1;
+    case 's':
+        rxrange(r, '\t', '\r');
+        rxrange(r, ' ', ' ');
+        return 1;
+    }
+    return 0;
+}
+
+static Rune
+rxunescape(Rune c)
+{
+    return c == 't' ? '\t' : c == 'e' ? '\033' : c;
+}
+
+static int
+rxchar(Regex *r, Rune c)
+{
+    return rxnew(r, RX_CHAR, r->icase ? rxlower(c) : c, 0);
+}
+
+/* [...], after the [ */
+static int
+rxclass(Regex *r)
+{
+    int start = r->nrange, neg = 0, first;
+    Rune c, lo;
+
+    if (r->pos < r->plen && r->pat[r->pos] == '^')
+    {
+        neg = 1;
+        r->pos++;
+    }
+    for (first = 1;; first = 0)
+    {
+        if (r->pos >= r->plen)
+        {
+            r->err = 1;
+            break;
+        }
+        c = r->pat[r->pos++];
+        if (c == ']' && !first)
+            break;
+        if (c == '\\' && r->pos < r->plen)
+        {
+            c = r->pat[r->pos++];
+            if (rxclassesc(r, c))
+                continue;
+            c = rxunescape(c);
+        }
+        lo = c;
+        if (r->pos + 1 < r->plen && r->pat[r->pos] == '-' && r->pat[r->pos + 1] != ']')
+        {
+            c = r->pat[r->pos + 1];
+            r->pos += 2;
+            if (c == '\\' && r->pos < r->plen)
+                c = rxunescape(r->pat[r->pos++]);
+            if (c < lo)
+                r->err = 1;
+        }
+        rxrange(r, lo, c);
+    }
+    return rxnew(r, neg ? RX_NCLASS : RX_CLASS, start, r->nrange - start);
+}
+
+static int rxalt(Regex *);
+
+static int
+rxatom(Regex *r)
+{
+    Rune c = r->pat[r->pos++];
+    int n, start;
+
+    if (r->flags & SEARCH_LITERAL)
+        return rxchar(r, c);
+
+    switch (c)
+    {
+    case '.':
+        return rxnew(r, RX_ANY, 0, 0);
+    case '^':
+        return rxnew(r, RX_BOL, 0, 0);
+    case '$':
+        return rxnew(r, RX_EOL, 0, 0);
+    case '[':
+        return rxclass(r);
+    case '(':
+        if (r->pos + 1 < r->plen && r->pat[r->pos] == '?' && r->pat[r->pos + 1] == ':')
+            r->pos += 2;
+        if (++r->depth > RX_DEPTH_MAX)
+        {
+            r->err = 1;
+            return rxnew(r, RX_CAT, 0, 0);
+        }
+        n = rxalt(r);
+        r->depth--;
+        if (r->pos < r->plen && r->pat[r->pos] == ')')
+            r->pos++;
+        else
+            r->err = 1;
+        return n;
+    case '*':
+    case '+':
+    case '?':
+        /* nothing to repeat */
+        r->err = 1;
+        return rxnew(r, RX_CAT, 0, 0);
+    case '\\':
+        if (r->pos >= r->plen)
+        {
+            r->err = 1;
+            return rxnew(r, RX_CAT, 0, 0);
+        }
+        c = r->pat[r->pos++];
+        if (c == 'b' || c == 'B')
+            return rxnew(r, c == 'b' ? RX_WORDB : RX_NWORDB, 0, 0);
+        start = r->nrange;
+        if (rxclassesc(r, c))
+            return rxnew(r, RX_CLASS, start, r->nrange - start);
+        if (rxclassesc(r, rxlower(c)))
+            return rxnew(r, RX_NCLASS, start, r->nrange - start);
+        return rxchar(r, rxunescape(c));
+    }
+    return rxchar(r, c);
+}
+
+/* {n}, {n,} or {n,m} at pos, which is left past it; 0 if there is none */
+static int
+rxcount(Regex *r, int *min, int *max)
+{
+    int i = r->pos + 1, n;
+
+    for (n = -1; i < r->plen && BETWEEN(r->pat[i], '0', '9'); i++)
+        n = MIN(MAX(n, 0) * 10 + (int)(r->pat[i] - '0'), RX_REP_MAX + 1);
+    if (n < 0 || i >= r->plen)
+        return 0;
+    *min = *max = n;
+    if (r->pat[i] == ',')
+    {
+        for (n = -1, i++; i < r->plen && BETWEEN(r->pat[i], '0', '9'); i++)
+            n = MIN(MAX(n, 0) * 10 + (int)(r->pat[i] - '0'), RX_REP_MAX + 1);
+        *max = n;
+    }
+    if (i >= r->plen || r->pat[i] != '}')
+        return 0;
+    if (*min > RX_REP_MAX || *max > RX_REP_MAX || (*max >= 0 && *max < *min))
+        r->err = 1;
+    r->pos = i + 1;
+    return 1;
+}
+
+static int
+rxrep(Regex *r)
+{
+    int n = rxatom(r), q, min, max, reps;
+    Rune c;
+
+    for (reps = 0; r->pos < r->plen && !(r->flags & SEARCH_LITERAL); reps++)
+    {
+        c = r->pat[r->pos];
+        if (c == '*' || c == '+' || c == '?')
+        {
+            min = c == '+';
+            max = c == '?' ? 1 : -1;
+            r->pos++;
+        }
+        else if (c != '{' || !rxcount(r, &min, &max))
+        {
+            break;
+        }
+        if (r->depth + reps >= RX_DEPTH_MAX)
+            r->err = 1;
+        q = rxnew(r, RX_REP, 0, 0);
+        r->node[q].kid = n;
+        r->node[q].min = min;
+        r->node[q].max = max;
+        if (r->pos < r->plen && r->pat[r->pos] == '?')
+        {
+            r->node[q].greedy = 0;
+            r->pos++;
+        }
+        n = q;
+    }
+    return n;
+}
+
+static int
+rxcat(Regex *r)
+{
+    int n = rxnew(r, RX_CAT, 0, 0), last = -1, k;
+    Rune c;
+
+    while (r->pos < r->plen && !r->err)
+    {
+        c = r->pat[r->pos];
+        if (!(r->flags & SEARCH_LITERAL) && (c == '|' || c == ')'))
+            break;
+        k = rxrep(r);
+        if (last < 0)
+            r->node[n].kid = k;
+        else
+            r->node[last].next = k;
+        last = k;
+    }
+    return n;
+}
+
+static int
+rxalt(Regex *r)
+{
+    int n = rxcat(r), a, last, k;
+
+    if (r->pos >= r->plen || r->pat[r->pos] != '|')
+        return n;
+    a = rxnew(r, RX_ALT, 0, 0);
+    r->node[a].kid = last = n;
+    while (r->pos < r->plen && r->pat[r->pos] == '|' && !r->err)
+    {
+        r->pos++;
+        k = rxcat(r);
+        r->node[last].next = k;
+        last = k;
+    }
+    return a;
+}
+
+static int
+rxinst(Regex *r, int op, int x, int y)
+{
+    if (r->len == RX_PROG_MAX)
+    {
+        r->err = 1;
+        return r->len - 1;
+    }
+    if (r->len == r->siz)
+    {
+        r->siz = MAX(2 * r->siz, 64);
+        r->prog = (RxInst *)xrealloc(r->prog, r->siz * sizeof(RxInst));
+    }
+    r->prog[r->len].op = op;
+    r->prog[r->len].x = x;
+    r->prog[r->len].y = y;
+    return r->len++;
+}
+
+/* points split s at the body it guards and past it, preferring one */
+static void
+rxbranch(Regex *r, int s, int body, int out, int greedy)
+{
+    r->prog[s].x = greedy ? body : out;
+    r->prog[s].y = greedy ? out : body;
+}
+
+static void
+rxemit(Regex *r, int n)
+{
+    RxNode nd = r->node[n];
+    int k, s, i, jmps = -1;
+
+    if (r->err)
+        return;
+    switch (nd.type)
+    {
+    case RX_CAT:
+        for (k = nd.kid; k >= 0; k = r->node[k].next)
+            rxemit(r, k);
+        break;
+    case RX_ALT:
+        /* the jumps past the alternatives are chained through x until the end is known */
+        for (k = nd.kid; r->node[k].next >= 0; k = r->node[k].next)
+        {
+            s = rxinst(r, RX_SPLIT, r->len + 1, 0);
+            rxemit(r, k);
+            jmps = rxinst(r, RX_JMP, jmps, 0);
+            r->prog[s].y = r->len;
+        }
+        rxemit(r, k);
+        while (jmps >= 0 && !r->err)
+        {
+            k = r->prog[jmps].x;
+            r->prog[jmps].x = r->len;
+            jmps = k;
+        }
+        break;
+    case RX_REP:
+        for (i = 0; i < nd.min && !r->err; i++)
+            rxemit(r, nd.kid);
+        if (nd.max < 0)
+        {
+            s = rxinst(r, RX_SPLIT, 0, 0);
+            rxemit(r, nd.kid);
+            rxinst(r, RX_JMP, s, 0);
+            rxbranch(r, s, s + 1, r->len, nd.greedy);
+        }
+        for (; i < nd.max && !r->err; i++)
+        {
+            s = rxinst(r, RX_SPLIT, 0, 0);
+            rxemit(r, nd.kid);
+            rxbranch(r, s, s + 1, r->len, nd.greedy);
+        }
+        break;
+    default:
+        rxinst(r, nd.type, nd.x, nd.y);
+        break;
+    }
+}
+
+/* keeps the run of len runes as the literal if it is the longest yet */
+static void
+rxkeep(Regex *r, const Rune *run, int len)
+{
+    if (len > r->nlit)
+    {
+        memcpy(r->lit, run, len * sizeof(Rune));
+        r->nlit = len;
+    }
+}
+
+/*
+ * Finds the longest run of runes every match of node n has, the run it
+ * goes on from in run and len.
+ */
+static void
+rxreq(Regex *r, int n, Rune *run, int *len)
+{
+    const RxNode *nd = &r->node[n];
+    Rune sub[RX_LIT_MAX];
+    int k, m = 0;
+
+    switch (nd->type)
+    {
+    case RX_CHAR:
+        if (*len < RX_LIT_MAX)
+            run[(*len)++] = nd->x;
+        return;
+    case RX_BOL:
+    case RX_EOL:
+    case RX_WORDB:
+    case RX_NWORDB:
+        return;
+    case RX_CAT:
+        for (k = nd->kid; k >= 0; k = r->node[k].next)
+            rxreq(r, k, run, len);
+        return;
+    }
+    rxkeep(r, run, *len);
+    *len = 0;
+    if (nd->type == RX_REP && nd->min > 0)
+    {
+        rxreq(r, nd->kid, sub, &m);
+        rxkeep(r, sub, m);
+    }
+}
+
+/* how rarely a rune shows up in terminal output, higher is rarer */
+static int
+rxrank(Rune u)
+{
+    if (u == ' ')
+        return 0;
+    if (BETWEEN(u, 'a', 'z'))
+        return strchr("etaoinsrhl", (int)u) ? 1 : 2;
+    if (BETWEEN(u, 'A', 'Z'))
+        return 4;
+    return u < 0x80 ? 3 : 5;
+}
+
+/* the runes below 256 a match can start with, all if it can be empty */
+static void
+rxfirst(Regex *r)
+{
+    const RxInst *in;
+    int sp = 0, pc, c, i;
+
+    memset(r->first, 0, sizeof(r->first));
+    r->high = 0;
+    r->stack[sp++] = 0;
+    while (sp)
+    {
+        pc = r->stack[--sp];
+        if (r->mark[pc])
+            continue;
+        r->mark[pc] = 1;
+        in = &r->prog[pc];
+        switch (in->op)
+        {
+        case RX_JMP:
+            r->stack[sp++] = in->x;
+            break;
+        case RX_SPLIT:
+            r->stack[sp++] = in->y;
+            r->stack[sp++] = in->x;
+            break;
+        case RX_BOL:
+        case RX_EOL:
+        case RX_WORDB:
+        case RX_NWORDB:
+            r->stack[sp++] = pc + 1;
+            break;
+        case RX_CHAR:
+            if (in->x < 256)
+                r->first[in->x >> 3] |= 1 << (in->x & 7);
+            else
+                r->high = 1;
+            break;
+        case RX_CLASS:
+        case RX_NCLASS:
+            for (c = 0; c < 256; c++)
+            {
+                for (i = 0; i < in->y; i++)
+                {
+                    if (BETWEEN((Rune)c, r->range[2 * (in->x + i)], r->range[2 * (in->x + i) + 1]) ||
+                        (r->icase && BETWEEN(rxupper(c), r->range[2 * (in->x + i)], r->range[2 * (in->x + i) + 1])))
+                        break;
+                }
+                if ((i < in->y) != (in->op == RX_NCLASS))
+                    r->first[c >> 3] |= 1 << (c & 7);
+            }
+            r->high = 1;
+            break;
+        default:
+            memset(r->first, 0xFF, sizeof(r->first));
+            r->high = 1;
+            sp = 0;
+            break;
+        }
+    }
+    memset(r->mark, 0, r->len * sizeof(uint));
+}
+
+static void
+rxfree(Regex *r)
+{
+    if (!r)
+        return;
+    free(r->prog);
+    free(r->node);
+    free(r->range);
+    free(r->clist);
+    free(r->nlist);
+    free(r->mark);
+    free(r->stack);
+    free(r);
+}
+
+/*
+ * Compiles the utf8 pattern, a regex unless flags has SEARCH_LITERAL.
+ * Returns NULL if it is empty or cannot be compiled.
+ */
+static Regex *
+rxcompile(const char *pattern, int flags)
+{
+    Regex *r;
+    Rune *pat, run[RX_LIT_MAX];
+    size_t n, len = strlen(pattern), k;
+    int i, j, root;
+
+    pat = (Rune *)xmalloc((len + 1) * sizeof(Rune));
+    for (n = 0; *pattern; pattern += k)
+        k = utf8decode(pattern, &pat[n++], UTF_SIZ);
+
+    r = (Regex *)xmalloc(sizeof(Regex));
+    memset(r, 0, sizeof(*r));
+    r->pat = pat;
+    r->plen = (int)n;
+    r->flags = flags;
+    r->icase = !!(flags & SEARCH_ICASE);
+    root = rxalt(r);
+    if (r->pos < r->plen)
+        r->err = 1;
+    rxemit(r, root);
+    rxinst(r, RX_MATCH, 0, 0);
+    i = 0;
+    rxreq(r, root, run, &i);
+    rxkeep(r, run, i);
+    free(pat);
+    r->pat = NULL;
+    if (r->err || !n)
+    {
+        rxfree(r);
+        return NULL;
+    }
+
+    r->clist = (RxThread *)xmalloc(r->len * sizeof(RxThread));
+    r->nlist = (RxThread *)xmalloc(r->len * sizeof(RxThread));
+    r->mark = (uint *)xmalloc(r->len * sizeof(uint));
+    r->stack = (int *)xmalloc((2 * r->len + 1) * sizeof(int));
+    memset(r->mark, 0, r->len * sizeof(uint));
+    rxfirst(r);
+
+    /*
+     * The prefilter looks for the rarest rune of the literal as stored, in
+     * either case if need be. Letters other than ASCII ones, and k and s,
+     * which other runes fold to, cannot be looked for that way.
+     */
+    r->scan = -1;
+    for (i = 0; i < r->nlit; i++)
+    {
+        if (r->icase && (r->lit[i] >= 0x80 || r->lit[i] == 'k' || r->lit[i] == 's'))
+            continue;
+        if (r->scan < 0 || rxrank(r->lit[i]) > rxrank(r->lit[r->scan]))
+            r->scan = i;
+    }
+    if (r->scan >= 0)
+    {
+        j = r->scan;
+        r->sa = r->lit[j];
+        r->sb = r->icase ? rxupper(r->lit[j]) : r->lit[j];
+    }
+    return r;
+}
+
+static int
+rxclassmatch(const Regex *r, const RxInst *in, Rune u)
+{
+    const Rune *p = r->range + 2 * in->x;
+    Rune v = r->icase ? rxupper(u) : u;
+    int i;
+
+    for (i = 0; i < in->y; i++)
+    {
+        if (BETWEEN(u, p[2 * i], p[2 * i + 1]) || BETWEEN(v, p[2 * i], p[2 * i + 1]))
+            break;
+    }
+    return (i < in->y) != (in->op == RX_NCLASS);
+}
+
+/*
+ * Adds the thread at pc to the n threads of l, following jumps and the
+ * assertions that hold at rune i of the n runes at s. Returns the threads
+ * of l; an instruction is only added once per generation.
+ */
+static int
+rxadd(Regex *r, RxThread *l, int nl, int pc, int start, const Rune *s, int n, int i, uint gen)
+{
+    const RxInst *in;
+    int sp = 0, w;
+
+    r->stack[sp++] = pc;
+    while (sp)
+    {
+        pc = r->stack[--sp];
+        if (r->mark[pc] == gen)
+            continue;
+        r->mark[pc] = gen;
+        in = &r->prog[pc];
+        switch (in->op)
+        {
+        case RX_JMP:
+            r->stack[sp++] = in->x;
+            break;
+        case RX_SPLIT:
+            /* x is taken first, the threads of l are in priority order */
+            r->stack[sp++] = in->y;
+            r->stack[sp++] = in->x;
+            break;
+        case RX_BOL:
+            if (i == 0)
+                r->stack[sp++] = pc + 1;
+            break;
+        case RX_EOL:
+            if (i == n)
+                r->stack[sp++] = pc + 1;
+            break;
+        case RX_WORDB:
+        case RX_NWORDB:
+            w = (i > 0 && RX_ISWORD(s[i - 1])) != (i < n && RX_ISWORD(s[i]));
+            if (w == (in->op == RX_WORDB))
+                r->stack[sp++] = pc + 1;
+            break;
+        default:
+            l[nl].pc = pc;
+            l[nl].start = start;
+            nl++;
+            break;
+        }
+    }
+    return nl;
+}
+
+/*
+ * Leftmost match of r in the n runes at s from the one at i, preferring
+ * what the pattern prefers, as Perl does. Sets its first rune and the one
+ * past it and returns 1, 0 if there is none.
+ */
+static int
+rxexec(Regex *r, const Rune *s, int n, int i, int *so, int *eo)
+{
+    RxThread *cl = r->clist, *nl = r->nlist, *t;
+    const RxInst *in;
+    int k, nc = 0, nn, matched = 0, ok;
+    uint base = r->gen;
+
+    /* the generation of the list of rune i is base + i + 1 */
+    r->gen += (uint)n + 2;
+    if (r->gen < base)
+    {
+        memset(r->mark, 0, r->len * sizeof(uint));
+        base = 0;
+        r->gen = (uint)n + 2;
+    }
+
+    for (;; i++)
+    {
+        if (!matched)
+        {
+            /* with no thread alive, skip to a rune a match can start with */
+            while (!nc && i < n && !RX_FIRST(r, s[i]))
+                i++;
+            nc = rxadd(r, cl, nc, 0, i, s, n, i, base + i + 1);
+        }
+        for (k = nn = 0; k < nc; k++)
+        {
+            in = &r->prog[cl[k].pc];
+            switch (in->op)
+            {
+            case RX_MATCH:
+                /* the threads after it have a lower priority */
+                *so = cl[k].start;
+                *eo = i;
+                matched = 1;
+                k = nc;
+                continue;
+            case RX_CHAR:
+                ok = i < n && s[i] == (Rune)in->x;
+                break;
+            case RX_ANY:
+                ok = i < n;
+                break;
+            default:
+                ok = i < n && rxclassmatch(r, in, s[i]);
+                break;
+            }
+            if (ok)
+                nn = rxadd(r, nl, nn, cl[k].pc + 1, cl[k].start, s, n, i + 1, base + i + 2);
+        }
+        if (i >= n || (matched && !nn))
+            break;
+        t = cl;
+        cl = nl;
+        nl = t;
+        nc = nn;
+    }
+    return matched;
+}
+
+/* the stored rune of a cell of a raw page or of the cache */
+static inline Rune
+histrune(const Glyph &g)
+{
+    return g.u;
+}
+
+/* masks of the stored rune and of ATTR_CLUSTER in a cell */
+static inline void
+histsig(Glyph *rune, Glyph *cluster)
+{
+    rune->u = ~0u;
+    cluster->mode = ATTR_CLUSTER;
+}
+
+#ifdef HEXE_COMPACT_CELLS
+static inline Rune
+histrune(const Cell &c)
+{
+    return CELL_RAW(c);
+}
+
+static inline void
+histsig(Cell *rune, Cell *cluster)
+{
+    rune->u = CELL_RUNE;
+    cluster->u = (uint32_t)ATTR_CLUSTER << CELL_SHIFT;
+}
+#endif
+
+/* the rune a cell is searched as, its clusters in pool */
+template <typename T>
+static inline Rune
+histbase(const T &c, const Rune *pool, int icase)
+{
+    Rune u = histrune(c);
+
+    if (histflags(c) & ATTR_CLUSTER)
+        u = pool[u + 1];
+    return icase ? rxlower(u) : u;
+}
+
+/*
+ * First of the n cells at c whose rune is a or b, or that holds a cluster
+ * which may have one of them as its base; n if there is none. A whole
+ * vector of cells per compare.
+ */
+template <typename T>
+static int
+histscan(const T *c, int n, Rune a, Rune b)
+{
+    int i = 0;
+
+#if defined(HEXE_AVX2) || defined(HEXE_SSE2)
+    int j, m, lanes, flags;
+#endif
+#if defined(HEXE_AVX2)
+    T pa[sizeof(__m256i) / sizeof(T)], pb[LEN(pa)], rm[LEN(pa)], cm[LEN(pa)];
+    __m256i va, vb, vr, vc, x, y;
+
+    memset(pa, 0, sizeof(pa));
+    memset(pb, 0, sizeof(pb));
+    memset(rm, 0, sizeof(rm));
+    memset(cm, 0, sizeof(cm));
+    for (j = 0; j < (int)LEN(pa); j++)
+    {
+        pa[j].u = a;
+        pb[j].u = b;
+        histsig(&rm[j], &cm[j]);
+    }
+    va = _mm256_loadu_si256((const __m256i *)pa);
+    vb = _mm256_loadu_si256((const __m256i *)pb);
+    vr = _mm256_loadu_si256((const __m256i *)rm);
+    vc = _mm256_loadu_si256((const __m256i *)cm);
+    /* the 32 bit lanes holding the rune and the flag */
+    lanes = ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(vr, _mm256_setzero_si256()))) & 0xFF;
+    flags = ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(vc, _mm256_setzero_si256()))) & 0xFF;
+    for (; i + (int)LEN(pa) <= n; i += LEN(pa))
+    {
+        x = _mm256_loadu_si256((const __m256i *)(c + i));
+        y = _mm256_and_si256(x, vr);
+        m = _mm256_movemask_ps(_mm256_castsi256_ps(
+                _mm256_or_si256(_mm256_cmpeq_epi32(y, va), _mm256_cmpeq_epi32(y, vb)))) & lanes;
+        m |= _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(x, vc), vc))) & flags;
+        if (m)
+            return i + ctz32(m) * 4 / sizeof(T);
+    }
+#elif defined(HEXE_SSE2)
+    T pa[sizeof(__m128i) / sizeof(T)], pb[LEN(pa)], rm[LEN(pa)], cm[LEN(pa)];
+    __m128i va, vb, vr, vc, x, y;
+
+    memset(pa, 0, sizeof(pa));
+    memset(pb, 0, sizeof(pb));
+    memset(rm, 0, sizeof(rm));
+    memset(cm, 0, sizeof(cm));
+    for (j = 0; j < (int)LEN(pa); j++)
+    {
+        pa[j].u = a;
+        pb[j].u = b;
+        histsig(&rm[j], &cm[j]);
+    }
+    va = _mm_loadu_si128((const __m128i *)pa);
+    vb = _mm_loadu_si128((const __m128i *)pb);
+    vr = _mm_loadu_si128((const __m128i *)rm);
+    vc = _mm_loadu_si128((const __m128i *)cm);
+    lanes = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(vr, _mm_setzero_si128()))) & 0xF;
+    flags = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(vc, _mm_setzero_si128()))) & 0xF;
+    for (; i + (int)LEN(pa) <= n; i += LEN(pa))
+    {
+        x = _mm_loadu_si128((const __m128i *)(c + i));
+        y = _mm_and_si128(x, vr);
+        m = _mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(_mm_cmpeq_epi32(y, va), _mm_cmpeq_epi32(y, vb)))) & lanes;
+        m |= _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(x, vc), vc))) & flags;
+        if (m)
+            return i + ctz32(m) * 4 / sizeof(T);
+    }
+#endif
+    for (; i < n; i++)
+    {
+        if (histrune(c[i]) == a || histrune(c[i]) == b || histflags(c[i]) & ATTR_CLUSTER)
+            break;
+    }
+    return i;
+}
+
+/*
+ * Whether the literal of r is in cells s to e of a line in c, the rune the
+ * prefilter looked for at cell pos.
+ */
+template <typename T>
+static int
+histlit(const Regex *r, const T *c, int s, int e, int pos, const Rune *pool)
+{
+    int j;
+
+    for (j = r->scan; j > 0; j--)
+    {
+        do
+            pos--;
+        while (pos >= s && histflags(c[pos]) & ATTR_WDUMMY);
+        if (pos < s)
+            return 0;
+    }
+    for (j = 0; j < r->nlit; j++, pos++)
+    {
+        while (pos < e && histflags(c[pos]) & ATTR_WDUMMY)
+            pos++;
+        if (pos >= e || histbase(c[pos], pool, r->icase) != r->lit[j])
+            return 0;
+    }
+    return 1;
+}
+
+static void
+srchgrow(Search *s, int n)
+{
+    if (n <= s->runesiz)
+        return;
+    s->runesiz = MAX(n, 2 * s->runesiz);
+    s->runes = (Rune *)xrealloc(s->runes, s->runesiz * sizeof(Rune));
+    s->at = (int *)xrealloc(s->at, s->runesiz * sizeof(int));
+}
+
+/*
+ * Appends the runes of the len cells at c to the n of s, without dummies,
+ * their cells numbered from off. Returns the runes of s.
+ */
+template <typename T>
+static int
+histrunes(Search *s, int n, const T *c, int len, int off, const Rune *pool)
+{
+    int i;
+
+    srchgrow(s, n + len);
+    for (i = 0; i < len; i++)
+    {
+        if (histflags(c[i]) & ATTR_WDUMMY)
+            continue;
+        s->runes[n] = histbase(c[i], pool, s->rx->icase);
+        s->at[n++] = off + i;
+    }
+    return n;
+}
+
+/* row of cell a of the len cells of a line at c wrapped at col, its column in x */
+template <typename T>
+static int
+histspot(const T *c, int len, int col, int a, int *x)
+{
+    int row, off, k;
+
+    for (row = off = 0;; row++, off += k)
+    {
+        k = histrow(c + off, len - off, col);
+        if (a < off + k || off + k >= len)
+            break;
+    }
+    *x = a - off;
+    return row;
+}
+
+/*
+ * Next match in the n runes of s from the one at *i, which is left past
+ * it. Its first and last cell go to a and b; empty matches are skipped.
+ */
+static int
+srchnext(Search *s, int n, int *i, int *a, int *b)
+{
+    int so = -1, eo = -1;
+
+    while (*i <= n && rxexec(s->rx, s->runes, n, *i, &so, &eo))
+    {
+        *i = eo > so ? eo : so + 1;
+        if (eo > so)
+        {
+            *a = s->at[so];
+            *b = s->at[eo - 1];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+srchpush(Search *s, int x0, uint y0, int x1, uint y1)
+{
+    SearchMatch *m;
+
+    if (s->nfound == s->foundsiz)
+    {
+        s->foundsiz = MAX(2 * s->foundsiz, 64);
+        s->found = (SearchMatch *)xrealloc(s->found, s->foundsiz * sizeof(SearchMatch));
+    }
+    m = &s->found[s->nfound++];
+    m->x0 = x0;
+    m->y0 = y0;
+    m->x1 = x1;
+    m->y1 = y1;
+}
+
+/*
+ * Searches lines i0 to n of a page, line i ending at cell end[i] of c and
+ * the last one before row, newest first. Rows are wrapped at col, matches
+ * from limit on were on the screen when it was searched. Returns the
+ * cells looked at, those run through the regex counting SEARCH_RX_COST.
+ */
+template <typename T>
+static int
+histsearch(Search *s, const T *c, const ushort *end, int i0, int n, uint row, uint limit, int col,
+           const Rune *pool)
+{
+    const Regex *r = s->rx;
+    int i, k, st, len, pos, stop, a, b, x0, x1, y0, y1, cost = 0;
+
+    if (i0 >= n)
+        return 0;
+
+    /* lines holding the literal of the pattern, if it has one */
+    memset(s->cand + i0, r->scan < 0, n - i0);
+    stop = end[n - 1];
+    for (i = i0, pos = i0 ? end[i0 - 1] : 0; r->scan >= 0 && pos < stop;)
+    {
+        pos += histscan(c + pos, stop - pos, r->sa, r->sb);
+        if (pos >= stop)
+            break;
+        while (end[i] <= pos)
+            i++;
+        if (histlit(r, c, i ? end[i - 1] : 0, end[i], pos, pool))
+        {
+            s->cand[i] = 1;
+            pos = end[i];
+        }
+        else
+        {
+            pos++;
+        }
+    }
+
+    for (i = n - 1; i >= i0; i--)
+    {
+        st = i ? end[i - 1] : 0;
+        len = end[i] - st;
+        pos = 0;
+        row -= histwalk(c + st, len, col, &pos);
+        if (!s->cand[i] || (int)(row - limit) >= 0)
+            continue;
+        /* as on the screen, a line ends at its last non blank */
+        for (k = histrunes(s, 0, c + st, len, 0, pool); k > 0 && s->runes[k - 1] == ' ';)
+            k--;
+        cost += (SEARCH_RX_COST - 1) * k;
+        for (pos = 0; srchnext(s, k, &pos, &a, &b);)
+        {
+            y0 = histspot(c + st, len, col, a, &x0);
+            y1 = histspot(c + st, len, col, b, &x1);
+            if ((int)(row + y0 - limit) >= 0)
+                break;
+            srchpush(s, x0, row + y0, x1 + !!(histflags(c[st + b]) & ATTR_WIDE), row + y1);
+        }
+    }
+    return cost + stop - (i0 ? end[i0 - 1] : 0);
+}
+
+/*
+ * Searches the lines of the screen shown, newest first, and returns the
+ * cells looked at. They are few, so they go straight to the regex.
+ */
+int TerminalEmulator::tsearchscreen(void)
+{
+    Search *s = &srch;
+    uint top = term.hist.npushed;
+    Cell *end;
+    int y, y0, r, n, len, i, a, b, wrap;
+
+    for (y = term.row - 1; y >= 0; y = y0 - 1)
+    {
+        for (y0 = y; y0 > 0 && CELL_FLAGS(term.line[y0 - 1][term.col - 1]) & ATTR_WRAP; y0--)
+            /* nothing */;
+        for (n = 0, r = y0; r <= y; r++)
+        {
+            wrap = r < y;
+            len = wrap ? term.col : tlinelen(r);
+
+            /* the blank left before a wide char that did not fit is padding */
+            end = &term.line[r][term.col - 1];
+            if (wrap && CELL_FLAGS(term.line[r + 1][0]) & ATTR_WIDE &&
+                CELL_RAW(*end) == ' ' && !(CELL_FLAGS(*end) & ATTR_CLUSTER))
+                len--;
+            n = histrunes(s, n, term.line[r], len, (r - y0) * term.col, term.clusters.buf);
+        }
+        /* a line wrapped onto a blank row ends before the blanks too */
+        while (n > 0 && s->runes[n - 1] == ' ')
+            n--;
+        for (i = 0; srchnext(s, n, &i, &a, &b);)
+        {
+            r = y0 + b / term.col;
+            srchpush(s, a % term.col, top + y0 + a / term.col,
+                     b % term.col + !!(CELL_FLAGS(term.line[r][b % term.col]) & ATTR_WIDE), top + r);
+        }
+    }
+    s->next = top;
+    return term.row * term.col;
+}
+
+/*
+ * Searches page k of the scrollback, its rows before srch.next, and returns
+ * the cells looked at. Unpacking a page costs SEARCH_UNPACK_COST a cell,
+ * reading it from the spill file a cell a byte. The rows before the page
+ * are searched next.
+ */
+int TerminalEmulator::tsearchpage(int k)
+{
+    History *h = &term.hist;
+    Search *s = &srch;
+    HistPage *p = HISTPAGE(h, k);
+    const Rune *pool = IS_SET(MODE_ALTSCREEN) ? term.altclusters.buf : term.clusters.buf;
+    int i = k ? 0 : h->first, n = 0;
+
+    if (!p->packed)
+    {
+        n = histsearch(s, HISTCELLS(p), HISTOFF(p), i, p->nline, p->start + p->rows, s->next, h->cols, pool);
+    }
+    else
+    {
+        if (h->unpacked != p)
+        {
+            if (p->state == HIST_DISK)
+                n += p->packed;
+            thunpack(p);
+            n += SEARCH_UNPACK_COST * (p->nline ? h->cacheoff[p->nline - 1] : 0);
+        }
+        n += histsearch(s, h->cache, h->cacheoff, i, p->nline, p->start + p->rows, s->next, h->cols, h->marks);
+    }
+    s->next = p->start;
+    return n;
+}
+
+/*
+ * Starts searching the screen and the scrollback for the utf8 pattern, a
+ * regex unless flags has SEARCH_LITERAL, dropping the search before.
+ * Matches are handed out by SearchStep. Returns -1 if the pattern is empty
+ * or cannot be compiled.
+ */
+int TerminalEmulator::SearchStart(const char *pattern, int flags)
+{
+    Search *s = &srch;
+
+    SearchCancel();
+    if (!(s->rx = rxcompile(pattern, flags)))
+        return -1;
+    s->screen = 1;
+    s->over = IS_SET(MODE_ALTSCREEN);
+    return 0;
+}
+
+/*
+ * Searches on for about searchstep cells, or until max matches are found,
+ * and copies at most max of them to matches: the screen shown first, then
+ * the scrollback from its newest line, each line from its left. Returns
+ * the matches copied, -1 once they were all handed out. A resize that
+ * wraps the lines again ends the search.
+ */
+int TerminalEmulator::SearchStep(SearchMatch *matches, int max)
+{
+    Search *s = &srch;
+    int budget = searchstep, n, k;
+
+    if (!s->rx)
+        return -1;
+    if (s->screen)
+    {
+        budget -= tsearchscreen();
+        s->screen = 0;
+    }
+    while (!s->over && budget > 0 && s->nfound - s->nsent < max)
+    {
+        if ((k = thpage(s->next - 1)) < 0)
+            s->over = 1;
+        else
+            budget -= tsearchpage(k);
+    }
+
+    n = MIN(max, s->nfound - s->nsent);
+    if (n > 0)
+        memcpy(matches, s->found + s->nsent, n * sizeof(SearchMatch));
+    s->nsent += n;
+    if (s->nsent == s->nfound)
+        s->nsent = s->nfound = 0;
+    if (!n && s->over && !s->nfound)
+    {
+        SearchCancel();
+        return -1;
+    }
+    return n;
+}
+
+void TerminalEmulator::SearchCancel(void)
+{
+    Search *s = &srch;
+
+    rxfree(s->rx);
+    free(s->found);
+    free(s->runes);
+    free(s->at);
+    memset(s, 0, sizeof(*s));
+}
+
+void TerminalEmulator::tscrolldown(int orig, int n)
+{
+    int i;
+    CellLine temp;
+
+    LIMIT(n, 0, term.bot - orig + 1);
+
+    tsetdirt(orig, term.bot - n);
+    tclearregion(0, term.bot - n + 1, term.col - 1, term.bot);
+
+    if (orig == 0 && term.bot == term.row - 1)
+    {
+        i = term.line - term.ring - n;
+        term.line = term.ring + (i < 0 ? i + term.row : i);
+    }
+    else
+    {
+        for (i = term.bot; i >= orig + n; i--)
+        {
+            temp = term.line[i];
+            term.line[i] = term.line[i - n];
+            term.line[i - n] = temp;
+        }
+        tmirror(orig, term.bot);
+    }
+
+    selscroll(orig, n);
+}
+
+void TerminalEmulator::tscrollup(int orig, int n)
+{
+    int i;
+    CellLine temp;
+
+    LIMIT(n, 0, term.bot - orig + 1);
+
+    if (orig == 0 && !IS_SET(MODE_ALTSCREEN))
+        thpush(n);
+
+    tclearregion(0, orig, term.col - 1, orig + n - 1);
+    tsetdirt(orig + n, term.bot);
+
+    if (orig == 0 && term.bot == term.row - 1)
+    {
+        i = term.line - term.ring + n;
+        term.line = term.ring + (i >= term.row ? i - term.row : i);
+    }
+    else
+    {
+        for (i = orig; i <= term.bot - n; i++)
+        {
+            temp = term.line[i];
+            term.line[i] = term.line[i + n];
+            term.line[i + n] = temp;
+        }
+        tmirror(orig, term.bot);
+    }
+
+    selscroll(orig, -n);
+}
+
+void TerminalEmulator::selscroll(int orig, int n)
+{
+    if (sel.ob.x == -1)
+        return;
+
+    if (BETWEEN(sel.nb.y, orig, term.bot) != BETWEEN(sel.ne.y, orig, term.bot))
+    {
+        selclear();
+    }
+    else if (BETWEEN(sel.nb.y, orig, term.bot))
+    {
+        sel.ob.y += n;
+        sel.oe.y += n;
+        if (sel.ob.y < term.top || sel.ob.y > term.bot ||
+            sel.oe.y < term.top || sel.oe.y > term.bot)
+        {
+            selclear();
+        }
+        else
+        {
+            selnormalize();
         }
     }
 }
@@ -856,35 +3863,40 @@ void TerminalEmulator::tnewline(int first_col)
     tmoveto(first_col ? 0 : term.c.x, y);
 }
 
-void TerminalEmulator::csiparse(void)
+/*
+ * Counts the line feeds at the start of s that will each scroll the region,
+ * s[0] being a line feed on the bottom line. Counting stops at anything but
+ * printable ASCII, CR and LF, and before text that would wrap, so that
+ * scrolling by the count up front and then moving the cursor up as many
+ * lines leaves the same screen. At most the region height - 1 are counted.
+ */
+int TerminalEmulator::tscrollahead(const char *s, size_t len)
 {
-    char *p = csiescseq.buf, *np;
-    long int v;
-
-    csiescseq.narg = 0;
-    if (*p == '?')
-    {
-        csiescseq.priv = 1;
-        p++;
-    }
+    int x = term.c.x, k = 0, max = term.bot - term.top;
+    size_t i;
 
-    csiescseq.buf[csiescseq.len] = '\0';
-    while (p < csiescseq.buf + csiescseq.len)
+    for (i = 0; i < len && k < max; i++)
     {
-        np = NULL;
-        v = strtol(p, &np, 10);
-        if (np == p)
-            v = 0;
-        if (v == LONG_MAX || v == LONG_MIN)
-            v = -1;
-        csiescseq.arg[csiescseq.narg++] = v;
-        p = np;
-        if (*p != ';' || csiescseq.narg == ESC_ARG_SIZ)
+        if (s[i] == '\n')
+        {
+            k++;
+            if (IS_SET(MODE_CRLF))
+                x = 0;
+        }
+        else if (s[i] == '\r')
+        {
+            x = 0;
+        }
+        else if (BETWEEN(s[i], 0x20, 0x7e) && x < term.col)
+        {
+            x++;
+        }
+        else
+        {
             break;
-        p++;
+        }
     }
-    csiescseq.mode[0] = *p++;
-    csiescseq.mode[1] = (p < csiescseq.buf + csiescseq.len) ? *p : '\0';
+    return k;
 }
 
 /* for absolute user moves, when decom is set */
@@ -933,32 +3945,199 @@ void TerminalEmulator::tsetchar(Rune u, Glyph *attr, int x, int y)
         BETWEEN(u, 0x41, 0x7e) && vt100_0[u - 0x41])
         utf8decode(vt100_0[u - 0x41], &u, UTF_SIZ);
 
-    if (term.line[y][x].mode & ATTR_WIDE)
+    if (ISSHARED(term.line[y]))
+        tunshare(y);
+
+    if (CELL_FLAGS(term.line[y][x]) & ATTR_WIDE)
     {
         if (x + 1 < term.col)
         {
-            term.line[y][x + 1].u = ' ';
-            term.line[y][x + 1].mode &= ~ATTR_WDUMMY;
+            CELL_SETU(term.line[y][x + 1], ' ');
+            CELL_CLRFLAG(term.line[y][x + 1], ATTR_WDUMMY);
         }
     }
-    else if (term.line[y][x].mode & ATTR_WDUMMY)
+    else if ((CELL_FLAGS(term.line[y][x]) & ATTR_WDUMMY) && x > 0)
+    {
+        CELL_SETU(term.line[y][x - 1], ' ');
+        CELL_CLRFLAG(term.line[y][x - 1], ATTR_WIDE | ATTR_CLUSTER);
+    }
+
+    /* a wide neighbour may have been blanked as well */
+    tsetdirtspan(y, MAX(x - 1, 0), MIN(x + 2, term.col));
+    ATTRCNT(term.line[y]) += !!(attr->mode & TRACKED_ATTR) -
+                             !!(CELL_MODE(term.line[y][x]) & TRACKED_ATTR);
+    CELL_SET(term.line[y][x], u, attr, CELL_STYLE(attr));
+
+    if (TerminalTraits::boxdraw && isboxdraw(u))
+        CELL_SETFLAG(term.line[y][x], ATTR_BOXDRAW);
+}
+
+/*
+ * fill n cells with c, a whole vector of cells per store
+ */
+void
+cellfill(Cell *dst, Cell c, int n)
+{
+    int i = 0;
+
+#if defined(HEXE_AVX2)
+    Cell pat[sizeof(__m256i) / sizeof(Cell)];
+    __m256i v;
+
+    for (; i < (int)LEN(pat); i++)
+        pat[i] = c;
+    v = _mm256_loadu_si256((const __m256i *)pat);
+    for (i = 0; i + (int)LEN(pat) <= n; i += LEN(pat))
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+#elif defined(HEXE_SSE2)
+    Cell pat[sizeof(__m128i) / sizeof(Cell)];
+    __m128i v;
+
+    for (; i < (int)LEN(pat); i++)
+        pat[i] = c;
+    v = _mm_loadu_si128((const __m128i *)pat);
+    for (i = 0; i + (int)LEN(pat) <= n; i += LEN(pat))
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+#endif
+    for (; i < n; i++)
+        dst[i] = c;
+}
+
+/*
+ * length of the n cells at line without the trailing ones equal to c,
+ * a whole vector of cells per compare
+ */
+int
+celltrim(const Cell *line, Cell c, int n)
+{
+#if defined(HEXE_AVX2) || defined(HEXE_SSE2)
+    Cell sig;
+    int i;
+
+    /* the bytes of a cell that are not padding */
+    memset(&sig, 0, sizeof(sig));
+    sig.u = ~0u;
+#ifdef HEXE_COMPACT_CELLS
+    sig.style = ~0u;
+#else
+    sig.mode = (ushort)~0;
+    sig.fg = sig.bg = ~0u;
+#endif
+#endif
+
+#if defined(HEXE_AVX2)
+    Cell pat[sizeof(__m256i) / sizeof(Cell)], msk[LEN(pat)];
+    __m256i v, m, x;
+
+    for (i = 0; i < (int)LEN(pat); i++)
+    {
+        pat[i] = c;
+        msk[i] = sig;
+    }
+    v = _mm256_loadu_si256((const __m256i *)pat);
+    m = _mm256_loadu_si256((const __m256i *)msk);
+    /* blank tails are long, four vectors are tested at once while they last */
+    for (; n >= 4 * (int)LEN(pat); n -= 4 * LEN(pat))
+    {
+        x = _mm256_or_si256(
+            _mm256_or_si256(_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(line + n - 4 * LEN(pat))), v),
+                            _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(line + n - 3 * LEN(pat))), v)),
+            _mm256_or_si256(_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(line + n - 2 * LEN(pat))), v),
+                            _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(line + n - LEN(pat))), v)));
+        if (!_mm256_testz_si256(x, m))
+            break;
+    }
+    for (; n >= (int)LEN(pat); n -= LEN(pat))
+    {
+        x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(line + n - LEN(pat))), v);
+        if (!_mm256_testz_si256(x, m))
+            break;
+    }
+#elif defined(HEXE_SSE2)
+    Cell pat[sizeof(__m128i) / sizeof(Cell)], msk[LEN(pat)];
+    __m128i v, m, x;
+
+    for (i = 0; i < (int)LEN(pat); i++)
+    {
+        pat[i] = c;
+        msk[i] = sig;
+    }
+    v = _mm_loadu_si128((const __m128i *)pat);
+    m = _mm_loadu_si128((const __m128i *)msk);
+    for (; n >= (int)LEN(pat); n -= LEN(pat))
+    {
+        x = _mm_and_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i *)(line + n - LEN(pat))), v), m);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) != 0xFFFF)
+            break;
+    }
+#endif
+    while (n > 0 && CELL_EQ(line[n - 1], c))
+        n--;
+    return n;
+}
+
+/*
+ * Points line y at the blank row filled with cell, handing its slab row
+ * back. A blank row nothing points at is refilled for a new cell; if all of
+ * them are in use with other cells 0 is returned and nothing changes.
+ */
+int TerminalEmulator::tshareblank(int y, Cell cell)
+{
+    CellLine l = term.line[y], b;
+    int i, k = -1, cur = ISSHARED(l) ? BLANKIDX(l) : -1;
+
+    for (i = 0; i < BLANK_ROWS; i++)
     {
-        term.line[y][x - 1].u = ' ';
-        term.line[y][x - 1].mode &= ~ATTR_WIDE;
+        b = term.blank + i * term.stride;
+        if (!memcmp(b, &cell, sizeof(Cell)))
+        {
+            k = i;
+            break;
+        }
+        if (k < 0 && term.blankref[i] == (i == cur))
+            k = i;
     }
+    if (k < 0)
+        return 0;
 
-    term.dirty[y] = 1;
-    term.line[y][x] = *attr;
-    term.line[y][x].u = u;
+    if (cur >= 0)
+        term.blankref[cur]--;
+    else
+        term.freerows[term.nfree++] = (l - term.slab) / term.stride;
+
+    b = term.blank + k * term.stride;
+    if (memcmp(b, &cell, sizeof(Cell)))
+        cellfill(b, cell, term.stride);
+    term.blankref[k]++;
+    term.line[y] = b;
+    tmirror(y, y);
+    return 1;
+}
 
-    if (isboxdraw(u))
-        term.line[y][x].mode |= ATTR_BOXDRAW;
+/*
+ * Gives line y, which points at a blank row, a slab row of its own holding
+ * the same cells. There is always one free: the slab has room for both
+ * screens and at least this line does not use its share.
+ */
+CellLine TerminalEmulator::tunshare(int y)
+{
+    CellLine l = term.line[y], r;
+
+    term.blankref[BLANKIDX(l)]--;
+    r = term.slab + term.freerows[--term.nfree] * term.stride;
+    cellfill(r, l[0], term.col);
+    ATTRCNT(r) = 0;
+    term.line[y] = r;
+    tmirror(y, y);
+    return r;
 }
 
 void TerminalEmulator::tclearregion(int x1, int y1, int x2, int y2)
 {
-    int x, y, temp;
-    Glyph *gp;
+    int y, temp, sx0, sx1;
+    Glyph blank;
+    Cell cell;
+    CellLine line;
 
     if (x1 > x2)
         temp = x1, x1 = x2, x2 = temp;
@@ -970,26 +4149,39 @@ void TerminalEmulator::tclearregion(int x1, int y1, int x2, int y2)
     LIMIT(y1, 0, term.row - 1);
     LIMIT(y2, 0, term.row - 1);
 
+    /* zeroed so the padding of a Glyph cell is the same in every copy */
+    memset(&blank, 0, sizeof(blank));
+    blank.fg = term.c.attr.fg;
+    blank.bg = term.c.attr.bg;
+    memset(&cell, 0, sizeof(cell));
+    CELL_SET(cell, ' ', &blank, CELL_STYLE(&blank));
+
     for (y = y1; y <= y2; y++)
     {
-        term.dirty[y] = 1;
-        for (x = x1; x <= x2; x++)
+        tsetdirtspan(y, x1, x2 + 1);
+        if (selspan(y, &sx0, &sx1) && sx0 <= x2 && x1 <= sx1)
+            selclear();
+
+        /* whole lines are shared, a blank line only needs a write to change */
+        if (x1 == 0 && x2 == term.col - 1 && tshareblank(y, cell))
+            continue;
+        line = term.line[y];
+        if (ISSHARED(line))
         {
-            gp = &term.line[y][x];
-            if (selected(x, y))
-                selclear();
-            gp->fg = term.c.attr.fg;
-            gp->bg = term.c.attr.bg;
-            gp->mode = 0;
-            gp->u = ' ';
+            if (!memcmp(line, &cell, sizeof(Cell)))
+                continue;
+            line = tunshare(y);
         }
+        cellfill(&line[x1], cell, x2 - x1 + 1);
+        if (ATTRCNT(line))
+            tcountattr(y);
     }
 }
 
 void TerminalEmulator::tdeletechar(int n)
 {
     int dst, src, size;
-    Glyph *line;
+    Cell *line;
 
     LIMIT(n, 0, term.col - term.c.x);
 
@@ -998,14 +4190,18 @@ void TerminalEmulator::tdeletechar(int n)
     size = term.col - src;
     line = term.line[term.c.y];
 
-    memmove(&line[dst], &line[src], size * sizeof(Glyph));
+    /* the cells of a blank line are all the same */
+    if (!ISSHARED(line))
+        memmove(&line[dst], &line[src], size * sizeof(Cell));
+    tsetdirtspan(term.c.y, dst, term.col);
+    /* recounts the attributes of the line */
     tclearregion(term.col - n, term.c.y, term.col - 1, term.c.y);
 }
 
 void TerminalEmulator::tinsertblank(int n)
 {
     int dst, src, size;
-    Glyph *line;
+    Cell *line;
 
     LIMIT(n, 0, term.col - term.c.x);
 
@@ -1014,7 +4210,10 @@ void TerminalEmulator::tinsertblank(int n)
     size = term.col - dst;
     line = term.line[term.c.y];
 
-    memmove(&line[dst], &line[src], size * sizeof(Glyph));
+    if (!ISSHARED(line))
+        memmove(&line[dst], &line[src], size * sizeof(Cell));
+    tsetdirtspan(term.c.y, src, term.col);
+    /* recounts the attributes of the line */
     tclearregion(src, term.c.y, dst - 1, term.c.y);
 }
 
@@ -1031,25 +4230,28 @@ void TerminalEmulator::tdeleteline(int n)
 }
 
 int32_t
-TerminalEmulator::tdefcolor(int *attr, int *npar, int l)
+TerminalEmulator::tdefcolor(int *attr, int *npar, int l, uint sub)
 {
     int32_t idx = -1;
     uint r, g, b;
+    int cs;
 
     switch (attr[*npar + 1])
     {
     case 2: /* direct color in RGB space */
-        if (*npar + 4 >= l)
+        /* the ':' form may carry a color space id: 38:2:<cs>:r:g:b */
+        cs = (sub >> (*npar + 5)) & 1;
+        if (*npar + 4 + cs >= l)
         {
             fprintf(stderr,
                     "erresc(38): Incorrect number of parameters (%d)\n",
                     *npar);
             break;
         }
-        r = attr[*npar + 2];
-        g = attr[*npar + 3];
-        b = attr[*npar + 4];
-        *npar += 4;
+        r = attr[*npar + 2 + cs];
+        g = attr[*npar + 3 + cs];
+        b = attr[*npar + 4 + cs];
+        *npar += 4 + cs;
         if (!BETWEEN(r, 0, 255) || !BETWEEN(g, 0, 255) || !BETWEEN(b, 0, 255))
             fprintf(stderr, "erresc: bad rgb color (%u,%u,%u)\n",
                     r, g, b);
@@ -1083,105 +4285,120 @@ TerminalEmulator::tdefcolor(int *attr, int *npar, int l)
     return idx;
 }
 
-void TerminalEmulator::tsetattr(int *attr, int l)
+/*
+ * Parses an SGR sequence into its effect on the cursor attributes. Returns
+ * 0 if a parameter was rejected, such sequences are not cached so that they
+ * keep being reported.
+ */
+int TerminalEmulator::tsgrparse(int *attr, int l, uint sub, SGRDelta *d)
 {
-    int i;
+    int i, ok = 1;
     int32_t idx;
 
+    d->set = d->clr = 0;
+    d->fgset = d->bgset = 0;
+
     for (i = 0; i < l; i++)
     {
         switch (attr[i])
         {
         case 0:
-            term.c.attr.mode &= ~(
-                ATTR_BOLD |
-                ATTR_FAINT |
-                ATTR_ITALIC |
-                ATTR_UNDERLINE |
-                ATTR_BLINK |
-                ATTR_REVERSE |
-                ATTR_INVISIBLE |
-                ATTR_STRUCK);
-            term.c.attr.fg = defaultfg;
-            term.c.attr.bg = defaultbg;
+            SGR_CLR(d, ATTR_BOLD |
+                           ATTR_FAINT |
+                           ATTR_ITALIC |
+                           ATTR_UNDERLINE |
+                           ATTR_BLINK |
+                           ATTR_REVERSE |
+                           ATTR_INVISIBLE |
+                           ATTR_STRUCK);
+            SGR_FG(d, defaultfg);
+            SGR_BG(d, defaultbg);
             break;
         case 1:
-            term.c.attr.mode |= ATTR_BOLD;
+            SGR_SET(d, ATTR_BOLD);
             break;
         case 2:
-            term.c.attr.mode |= ATTR_FAINT;
+            SGR_SET(d, ATTR_FAINT);
             break;
         case 3:
-            term.c.attr.mode |= ATTR_ITALIC;
+            SGR_SET(d, ATTR_ITALIC);
             break;
         case 4:
-            term.c.attr.mode |= ATTR_UNDERLINE;
+            /* 4:0 turns underlining off, other styles map to single */
+            if (i + 1 < l && (sub >> (i + 1)) & 1 && attr[i + 1] == 0)
+                SGR_CLR(d, ATTR_UNDERLINE);
+            else
+                SGR_SET(d, ATTR_UNDERLINE);
             break;
         case 5: /* slow blink */
                 /* FALLTHROUGH */
         case 6: /* rapid blink */
-            term.c.attr.mode |= ATTR_BLINK;
+            SGR_SET(d, ATTR_BLINK);
             break;
         case 7:
-            term.c.attr.mode |= ATTR_REVERSE;
+            SGR_SET(d, ATTR_REVERSE);
             break;
         case 8:
-            term.c.attr.mode |= ATTR_INVISIBLE;
+            SGR_SET(d, ATTR_INVISIBLE);
             break;
         case 9:
-            term.c.attr.mode |= ATTR_STRUCK;
+            SGR_SET(d, ATTR_STRUCK);
             break;
         case 22:
-            term.c.attr.mode &= ~(ATTR_BOLD | ATTR_FAINT);
+            SGR_CLR(d, ATTR_BOLD | ATTR_FAINT);
             break;
         case 23:
-            term.c.attr.mode &= ~ATTR_ITALIC;
+            SGR_CLR(d, ATTR_ITALIC);
             break;
         case 24:
-            term.c.attr.mode &= ~ATTR_UNDERLINE;
+            SGR_CLR(d, ATTR_UNDERLINE);
             break;
         case 25:
-            term.c.attr.mode &= ~ATTR_BLINK;
+            SGR_CLR(d, ATTR_BLINK);
             break;
         case 27:
-            term.c.attr.mode &= ~ATTR_REVERSE;
+            SGR_CLR(d, ATTR_REVERSE);
             break;
         case 28:
-            term.c.attr.mode &= ~ATTR_INVISIBLE;
+            SGR_CLR(d, ATTR_INVISIBLE);
             break;
         case 29:
-            term.c.attr.mode &= ~ATTR_STRUCK;
+            SGR_CLR(d, ATTR_STRUCK);
             break;
         case 38:
-            if ((idx = tdefcolor(attr, &i, l)) >= 0)
-                term.c.attr.fg = idx;
+            if ((idx = tdefcolor(attr, &i, l, sub)) >= 0)
+                SGR_FG(d, idx);
+            else
+                ok = 0;
             break;
         case 39:
-            term.c.attr.fg = defaultfg;
+            SGR_FG(d, defaultfg);
             break;
         case 48:
-            if ((idx = tdefcolor(attr, &i, l)) >= 0)
-                term.c.attr.bg = idx;
+            if ((idx = tdefcolor(attr, &i, l, sub)) >= 0)
+                SGR_BG(d, idx);
+            else
+                ok = 0;
             break;
         case 49:
-            term.c.attr.bg = defaultbg;
+            SGR_BG(d, defaultbg);
             break;
         default:
             if (BETWEEN(attr[i], 30, 37))
             {
-                term.c.attr.fg = attr[i] - 30;
+                SGR_FG(d, attr[i] - 30);
             }
             else if (BETWEEN(attr[i], 40, 47))
             {
-                term.c.attr.bg = attr[i] - 40;
+                SGR_BG(d, attr[i] - 40);
             }
             else if (BETWEEN(attr[i], 90, 97))
             {
-                term.c.attr.fg = attr[i] - 90 + 8;
+                SGR_FG(d, attr[i] - 90 + 8);
             }
             else if (BETWEEN(attr[i], 100, 107))
             {
-                term.c.attr.bg = attr[i] - 100 + 8;
+                SGR_BG(d, attr[i] - 100 + 8);
             }
             else
             {
@@ -1189,10 +4406,31 @@ void TerminalEmulator::tsetattr(int *attr, int l)
                         "erresc(default): gfx attr %d unknown\n",
                         attr[i]);
                 csidump();
+                ok = 0;
             }
             break;
         }
+        /* skip sub-parameters the attribute did not consume */
+        while (i + 1 < l && (sub >> (i + 1)) & 1)
+            i++;
     }
+
+    return ok;
+}
+
+void TerminalEmulator::tsgrapply(const SGRDelta *d)
+{
+    term.c.attr.mode = (term.c.attr.mode & ~d->clr) | d->set;
+    if (d->fgset)
+        term.c.attr.fg = d->fg;
+    if (d->bgset)
+        term.c.attr.bg = d->bg;
+}
+
+void TerminalEmulator::tsetattr(int *attr, int l, uint sub)
+{
+    sgrok = tsgrparse(attr, l, sub, &sgrlast);
+    tsgrapply(&sgrlast);
 }
 
 void TerminalEmulator::tsetscroll(int t, int b)
@@ -1302,6 +4540,11 @@ void TerminalEmulator::tsetmode(int priv, int set, int *args, int narg)
             case 2004: /* 2004: bracketed paste mode */
                 xsetmode(set, MODE_BRCKTPASTE);
                 break;
+            case 2026: /* 2026: synchronized update */
+                if (set && !IS_SET(MODE_SYNC))
+                    m_syncStart = std::chrono::steady_clock::now();
+                MODBIT(term.mode, set, MODE_SYNC);
+                break;
             /* Not implemented mouse modes. See comments there. */
             case 1001: /* mouse highlight mode; can hang the
 				      terminal by design when implemented. */
@@ -1354,7 +4597,15 @@ void TerminalEmulator::csihandle(void)
 
     std::shared_ptr<TerminalDisplay> dpy{};
 
-    switch (csiescseq.mode[0])
+    /* only DEC private ('?') sequences are implemented */
+    if (csiescseq.priv && csiescseq.priv != '?')
+    {
+        fprintf(stderr, "erresc: unknown csi ");
+        csidump();
+        return;
+    }
+
+    switch (csiescseq.inter ? csiescseq.inter : csiescseq.mode)
     {
     default:
     unknown:
@@ -1391,7 +4642,8 @@ void TerminalEmulator::csihandle(void)
             term.mode &= ~MODE_PRINT;
             break;
         case 5:
-            term.mode |= MODE_PRINT;
+            if (TerminalTraits::printer)
+                term.mode |= MODE_PRINT;
             break;
         }
         break;
@@ -1469,6 +4721,9 @@ void TerminalEmulator::csihandle(void)
         case 2: /* all */
             tclearregion(0, 0, term.col - 1, term.row - 1);
             break;
+        case 3: /* scrollback */
+            thclear();
+            break;
         default:
             goto unknown;
         }
@@ -1501,7 +4756,7 @@ void TerminalEmulator::csihandle(void)
         tinsertblankline(csiescseq.arg[0]);
         break;
     case 'l': /* RM -- Reset Mode */
-        tsetmode(csiescseq.priv, 0, csiescseq.arg, csiescseq.narg);
+        tsetmode(csiescseq.priv == '?', 0, csiescseq.arg, csiescseq.narg);
         break;
     case 'M': /* DL -- Delete <n> lines */
         DEFAULT(csiescseq.arg[0], 1);
@@ -1525,10 +4780,10 @@ void TerminalEmulator::csihandle(void)
         tmoveato(term.c.x, csiescseq.arg[0] - 1);
         break;
     case 'h': /* SM -- Set terminal mode */
-        tsetmode(csiescseq.priv, 1, csiescseq.arg, csiescseq.narg);
+        tsetmode(csiescseq.priv == '?', 1, csiescseq.arg, csiescseq.narg);
         break;
     case 'm': /* SGR -- Terminal attribute (color) */
-        tsetattr(csiescseq.arg, csiescseq.narg);
+        tsetattr(csiescseq.arg, csiescseq.narg, csiescseq.sub);
         break;
     case 'n': /* DSR – Device Status Report (cursor position) */
         if (csiescseq.arg[0] == 6)
@@ -1558,7 +4813,7 @@ void TerminalEmulator::csihandle(void)
         tcursor(CURSOR_LOAD);
         break;
     case ' ':
-        switch (csiescseq.mode[1])
+        switch (csiescseq.mode)
         {
         case 'q': /* DECSCUSR -- Set Cursor Style */
             if (csiescseq.arg[0] < 0 || csiescseq.arg[0] < cursor_mode::MAX_CURSOR)
@@ -1573,42 +4828,34 @@ void TerminalEmulator::csihandle(void)
     }
 }
 
+/* the raw sequence is not kept, so print it back from the parsed fields */
 void TerminalEmulator::csidump(void)
 {
-    size_t i;
-    uint c;
+    int i;
 
     fprintf(stderr, "ESC[");
-    for (i = 0; i < csiescseq.len; i++)
+    if (csiescseq.priv)
+        putc(csiescseq.priv, stderr);
+    for (i = 0; i < csiescseq.narg; i++)
     {
-        c = csiescseq.buf[i] & 0xff;
-        if (isprint(c))
-        {
-            putc(c, stderr);
-        }
-        else if (c == '\n')
-        {
-            fprintf(stderr, "(\\n)");
-        }
-        else if (c == '\r')
-        {
-            fprintf(stderr, "(\\r)");
-        }
-        else if (c == 0x1b)
-        {
-            fprintf(stderr, "(\\e)");
-        }
-        else
-        {
-            fprintf(stderr, "(%02x)", c);
-        }
+        if (i > 0)
+            putc((csiescseq.sub >> i) & 1 ? ':' : ';', stderr);
+        fprintf(stderr, "%d", csiescseq.arg[i]);
     }
+    if (csiescseq.inter)
+        putc(csiescseq.inter, stderr);
+    putc(csiescseq.mode, stderr);
     putc('\n', stderr);
 }
 
 void TerminalEmulator::csireset(void)
 {
-    memset(&csiescseq, 0, sizeof(csiescseq));
+    csiescseq.priv = 0;
+    csiescseq.inter = 0;
+    csiescseq.sub = 0;
+    csiescseq.narg = 0;
+    csiescseq.mode = 0;
+    memset(csiescseq.arg, 0, sizeof(csiescseq.arg));
 }
 
 void TerminalEmulator::strhandle(void)
@@ -1616,7 +4863,13 @@ void TerminalEmulator::strhandle(void)
     char *p = NULL, *dec;
     int j, narg, par;
 
-    term.esc &= ~(ESC_STR_END | ESC_STR);
+    if (strescseq.overflow)
+    {
+        fprintf(stderr, "erresc: string longer than %zu bytes dropped\n",
+                strmaxlen);
+        return;
+    }
+
     strparse();
     par = (narg = strescseq.narg) ? atoi(strescseq.args[0]) : 0;
 
@@ -1648,14 +4901,7 @@ void TerminalEmulator::strhandle(void)
             if (narg > 2 && allowwindowops)
             {
                 dec = base64dec(strescseq.args[2]);
-                if (dec)
-                {
-                    SetClipboard(dec);
-                }
-                else
-                {
-                    fprintf(stderr, "erresc: invalid base64\n");
-                }
+                SetClipboard(dec);
             }
             return;
         case 4: /* color set */
@@ -1758,10 +5004,22 @@ void TerminalEmulator::strdump(void)
 
 void TerminalEmulator::strreset(void)
 {
-    auto old = strescseq.buf;
+    char *buf = strescseq.buf;
+    size_t siz = strescseq.siz;
+
+    /*
+     * the buffer grows up to strmaxlen for a long string, and shrinks
+     * back once the string is handled or the next one starts
+     */
+    if (!buf || siz > STR_BUF_SIZ)
+    {
+        free(buf);
+        buf = (char *)xmalloc(STR_BUF_SIZ);
+        siz = STR_BUF_SIZ;
+    }
     strescseq = STREscape{};
-    strescseq.buf = (char *)xrealloc(old, STR_BUF_SIZ);
-    strescseq.siz = STR_BUF_SIZ;
+    strescseq.buf = buf;
+    strescseq.siz = siz;
 }
 
 void TerminalEmulator::sendbreak(const Arg *arg)
@@ -1784,7 +5042,8 @@ void TerminalEmulator::tprinter(const char *s, size_t len)
 
 void TerminalEmulator::toggleprinter(const Arg *arg)
 {
-    term.mode ^= MODE_PRINT;
+    if (TerminalTraits::printer)
+        term.mode ^= MODE_PRINT;
 }
 
 void TerminalEmulator::printscreen(const Arg *arg)
@@ -1810,15 +5069,15 @@ void TerminalEmulator::tdumpsel(void)
 
 void TerminalEmulator::tdumpline(int n)
 {
-    char buf[UTF_SIZ];
-    Glyph *bp, *end;
+    char buf[CLUSTER_MAX * UTF_SIZ];
+    Cell *bp, *end;
 
     bp = &term.line[n][0];
     end = &bp[MIN(tlinelen(n), term.col) - 1];
-    if (bp != end || bp->u != ' ')
+    if (bp != end || CELL_U(*bp) != ' ')
     {
         for (; bp <= end; ++bp)
-            tprinter(buf, utf8encode(bp->u, buf));
+            tprinter(buf, cellencode(*bp, buf));
     }
     tprinter("\n", 1);
 }
@@ -1854,7 +5113,7 @@ void TerminalEmulator::tdefutf8(char ascii)
 {
     if (ascii == 'G')
         term.mode |= MODE_UTF8;
-    else if (ascii == '@')
+    else if (ascii == '@' && !TerminalTraits::utf8only)
         term.mode &= ~MODE_UTF8;
 }
 
@@ -1864,7 +5123,7 @@ void TerminalEmulator::tdeftran(char ascii)
     static int vcs[] = {CS_GRAPHIC0, CS_USA};
     char *p;
 
-    if ((p = strchr(cs, ascii)) == NULL)
+    if (!ascii || (p = strchr(cs, ascii)) == NULL)
     {
         fprintf(stderr, "esc unhandled charset: ESC ( %c\n", ascii);
     }
@@ -1907,7 +5166,6 @@ void TerminalEmulator::tstrsequence(uchar c)
     }
     strreset();
     strescseq.type = c;
-    term.esc |= ESC_STR;
 }
 
 void TerminalEmulator::tcontrolcode(uchar ascii)
@@ -1930,22 +5188,11 @@ void TerminalEmulator::tcontrolcode(uchar ascii)
         tnewline(IS_SET(MODE_CRLF));
         return;
     case '\a': /* BEL */
-        if (term.esc & ESC_STR_END)
-        {
-            /* backwards compatibility to xterm */
-            strhandle();
-        }
-        else
-        {
-            auto belDpyPtr = m_dpy.lock();
-            belDpyPtr->Bell();
-        }
-        break;
-    case '\033': /* ESC */
-        csireset();
-        term.esc &= ~(ESC_CSI | ESC_ALTCHARSET | ESC_TEST);
-        term.esc |= ESC_START;
+    {
+        auto belDpyPtr = m_dpy.lock();
+        belDpyPtr->Bell();
         return;
+    }
     case '\016': /* SO (LS1 -- Locking shift 1) */
     case '\017': /* SI (LS0 -- Locking shift 0) */
         term.charset = 1 - (ascii - '\016');
@@ -1955,7 +5202,7 @@ void TerminalEmulator::tcontrolcode(uchar ascii)
         /* FALLTHROUGH */
     case '\030': /* CAN */
         csireset();
-        break;
+        return;
     case '\005': /* ENQ (IGNORED) */
     case '\000': /* NUL (IGNORED) */
     case '\021': /* XON (IGNORED) */
@@ -1967,16 +5214,16 @@ void TerminalEmulator::tcontrolcode(uchar ascii)
     case 0x82: /* TODO: BPH */
     case 0x83: /* TODO: NBH */
     case 0x84: /* TODO: IND */
-        break;
+        return;
     case 0x85:       /* NEL -- Next line */
         tnewline(1); /* always go to first col */
-        break;
+        return;
     case 0x86: /* TODO: SSA */
     case 0x87: /* TODO: ESA */
-        break;
+        return;
     case 0x88: /* HTS -- Horizontal tab stop */
         term.tabs[term.c.x] = 1;
-        break;
+        return;
     case 0x89: /* TODO: HTJ */
     case 0x8a: /* TODO: VTS */
     case 0x8b: /* TODO: PLD */
@@ -1993,59 +5240,52 @@ void TerminalEmulator::tcontrolcode(uchar ascii)
     case 0x97: /* TODO: EPA */
     case 0x98: /* TODO: SOS */
     case 0x99: /* TODO: SGCI */
-        break;
+        return;
     case 0x9a: /* DECID -- Identify Terminal */
         ttywrite(vtiden, strlen(vtiden), 0);
-        break;
+        return;
     case 0x9b: /* TODO: CSI */
-    case 0x9c: /* TODO: ST */
-        break;
-    case 0x90: /* DCS -- Device Control String */
-    case 0x9d: /* OSC -- Operating System Command */
-    case 0x9e: /* PM -- Privacy Message */
-    case 0x9f: /* APC -- Application Program Command */
-        tstrsequence(ascii);
+    case 0x9c: /* ST outside of a string */
         return;
     }
-    /* only CAN, SUB, \a and C1 chars interrupt a sequence */
-    term.esc &= ~(ESC_STR_END | ESC_STR);
+    /* ESC and the string introducers are handled by the parser itself */
 }
 
 /*
- * returns 1 when the sequence is finished and it hasn't to read
- * more characters for this sequence, otherwise 0
+ * Dispatches a finished ESC sequence, the intermediate (if any) has been
+ * collected into csiescseq.inter
  */
-int TerminalEmulator::eschandle(uchar ascii)
+void TerminalEmulator::eschandle(uchar ascii)
 {
+    if (csiescseq.inter)
+    {
+        switch (csiescseq.inter)
+        {
+        case '#':
+            tdectest(ascii);
+            return;
+        case '%':
+            tdefutf8(ascii);
+            return;
+        case '(': /* GZD4 -- set primary charset G0 */
+        case ')': /* G1D4 -- set secondary charset G1 */
+        case '*': /* G2D4 -- set tertiary charset G2 */
+        case '+': /* G3D4 -- set quaternary charset G3 */
+            term.icharset = csiescseq.inter - '(';
+            tdeftran(ascii);
+            return;
+        }
+        fprintf(stderr, "erresc: unknown sequence ESC %c 0x%02X '%c'\n",
+                csiescseq.inter, (uchar)ascii, isprint(ascii) ? ascii : '.');
+        return;
+    }
+
     switch (ascii)
     {
-    case '[':
-        term.esc |= ESC_CSI;
-        return 0;
-    case '#':
-        term.esc |= ESC_TEST;
-        return 0;
-    case '%':
-        term.esc |= ESC_UTF8;
-        return 0;
-    case 'P': /* DCS -- Device Control String */
-    case '_': /* APC -- Application Program Command */
-    case '^': /* PM -- Privacy Message */
-    case ']': /* OSC -- Operating System Command */
-    case 'k': /* old title set compatibility */
-        tstrsequence(ascii);
-        return 0;
     case 'n': /* LS2 -- Locking shift 2 */
     case 'o': /* LS3 -- Locking shift 3 */
         term.charset = 2 + (ascii - 'n');
         break;
-    case '(': /* GZD4 -- set primary charset G0 */
-    case ')': /* G1D4 -- set secondary charset G1 */
-    case '*': /* G2D4 -- set tertiary charset G2 */
-    case '+': /* G3D4 -- set quaternary charset G3 */
-        term.icharset = ascii - '(';
-        term.esc |= ESC_ALTCHARSET;
-        return 0;
     case 'D': /* IND -- Linefeed */
         if (term.c.y == term.bot)
         {
@@ -2092,275 +5332,1132 @@ int TerminalEmulator::eschandle(uchar ascii)
     case '8': /* DECRC -- Restore Cursor */
         tcursor(CURSOR_LOAD);
         break;
-    case '\\': /* ST -- String Terminator */
-        if (term.esc & ESC_STR_END)
-            strhandle();
+    case '\\': /* ST -- String Terminator (without a string) */
         break;
     default:
         fprintf(stderr, "erresc: unknown sequence ESC 0x%02X '%c'\n",
                 (uchar)ascii, isprint(ascii) ? ascii : '.');
         break;
     }
+}
+
+void TerminalEmulator::tputc(Rune u)
+{
+    char c[UTF_SIZ];
+    size_t len = 0;
+    uchar t;
+
+    if (PRINTING() || term.esc == ESC_STR)
+    {
+        if (u < 127 || !UTF8MODE())
+        {
+            c[0] = u;
+            len = 1;
+        }
+        else
+        {
+            len = utf8encode(u, c);
+        }
+        if (PRINTING())
+            tprinter(c, len);
+    }
+
+    t = vtparse.t[term.esc][u < LEN(vtclass.c) ? vtclass.c[u] : (uchar)CL_HIGH];
+    term.esc = VT_STATE(t);
+
+    switch (VT_ACTION(t))
+    {
+    case ACT_NONE:
+        break;
+    case ACT_PRINT:
+        tputglyph(u);
+        break;
+    case ACT_EXECUTE:
+        /*
+         * Actions of control codes must be performed as soon they arrive
+         * because they can be embedded inside a control sequence, and
+         * they must not cause conflicts with sequences.
+         */
+        tcontrolcode(u);
+        /*
+         * control codes are not shown ever
+         */
+        if (term.esc == ESC_GROUND)
+            term.lastc = 0;
+        break;
+    case ACT_CLEAR:
+        csireset();
+        break;
+    case ACT_COLLECT:
+        /* ESC sequences dispatch on their first intermediate */
+        if (!csiescseq.inter)
+            csiescseq.inter = u;
+        break;
+    case ACT_PRIV:
+        csiescseq.priv = u;
+        break;
+    case ACT_PARAM:
+        /* parameters past ESC_ARG_SIZ are dropped */
+        if (csiescseq.narg < ESC_ARG_SIZ)
+        {
+            int *a = &csiescseq.arg[csiescseq.narg];
+            *a = MIN(*a * 10 + (int)(u - '0'), ESC_ARG_MAX);
+        }
+        break;
+    case ACT_SEP:
+        if (csiescseq.narg < ESC_ARG_SIZ && ++csiescseq.narg < ESC_ARG_SIZ && u == ':')
+            csiescseq.sub |= 1u << csiescseq.narg;
+        break;
+    case ACT_ESC_DISPATCH:
+        eschandle(u);
+        break;
+    case ACT_CSI_DISPATCH:
+        /* narg indexes the current parameter while parsing */
+        csiescseq.narg = MIN(csiescseq.narg + 1, ESC_ARG_SIZ);
+        csiescseq.mode = u;
+        csihandle();
+        break;
+    case ACT_STR_START:
+        tstrsequence(u);
+        break;
+    case ACT_STR_PUT:
+        if (strescseq.overflow)
+            break;
+        if (strescseq.len + len >= strescseq.siz)
+        {
+            /*
+             * A string that is never terminated would otherwise grow
+             * without bound. Past strmaxlen the rest of it is dropped
+             * until the terminator, which then reports it.
+             */
+            if (strescseq.len + len > strmaxlen)
+            {
+                strescseq.overflow = 1;
+                break;
+            }
+            strescseq.siz = MIN(strescseq.siz * 2, strmaxlen + 1);
+            strescseq.buf = (char *)xrealloc(strescseq.buf, strescseq.siz);
+        }
+
+        memmove(&strescseq.buf[strescseq.len], c, len);
+        strescseq.len += len;
+        break;
+    case ACT_STR_DISPATCH:
+        strhandle();
+        strreset();
+        /* as for the control codes above, unlike ESC '\\' */
+        if (ISCONTROL(u))
+            term.lastc = 0;
+        break;
+    }
+}
+
+/*
+ * Adds u to the glyph before the cursor if it has no width, or if that glyph
+ * ends with a zero width joiner. Returns 0 if u takes cells of its own.
+ * Runes past CLUSTER_MAX, or with the pool full, are dropped.
+ */
+int TerminalEmulator::tcombine(Rune u, int width)
+{
+    int x = term.c.x, y = term.c.y, i, j, n;
+    Rune *r;
+    Cell *gp;
+
+    if (!(term.c.state & CURSOR_WRAPNEXT))
+        x--;
+    if (x < 0)
+        return !width;
+    if (x > 0 && (CELL_FLAGS(term.line[y][x]) & ATTR_WDUMMY))
+        x--;
+    gp = &term.line[y][x];
+
+    if (CELL_FLAGS(*gp) & ATTR_CLUSTER)
+    {
+        i = CELL_RAW(*gp);
+        n = term.clusters.buf[i];
+        if (width && term.clusters.buf[i + n] != 0x200D)
+            return 0;
+    }
+    else
+    {
+        if (width)
+            return 0;
+        i = -1;
+        n = 1;
+    }
+    if (n == CLUSTER_MAX)
+        return 1;
+
+    if (selected(x, y))
+        selclear();
+    gp = &WLINE(y)[x];
+
+    if (i >= 0 && i + 1 + n == term.clusters.len && term.clusters.len < term.clusters.siz)
+    {
+        /* the newest entry grows in place */
+        term.clusters.buf[term.clusters.len++] = u;
+        term.clusters.buf[i]++;
+    }
+    else
+    {
+        /* may collect the pool, which moves the entry of gp */
+        if ((j = tclusteralloc(n + 2)) < 0)
+            return 1;
+        r = term.clusters.buf;
+        if (CELL_FLAGS(*gp) & ATTR_CLUSTER)
+            memcpy(&r[j + 1], &r[CELL_RAW(*gp) + 1], n * sizeof(Rune));
+        else
+            r[j + 1] = CELL_RAW(*gp);
+        r[j] = n + 1;
+        r[j + 1 + n] = u;
+        CELL_SETU(*gp, j);
+        CELL_SETFLAG(*gp, ATTR_CLUSTER);
+    }
+    tsetdirtspan(y, x, MIN(x + 2, term.col));
     return 1;
 }
 
-static const unsigned char table[] = {
-#include "nonspacing.h"
-};
+/*
+ * Returns the index of n free runes at the end of the pool of the screen
+ * shown, or -1. A full pool is collected first, and only grows when that
+ * leaves it more than half full.
+ */
+int TerminalEmulator::tclusteralloc(int n)
+{
+    ClusterPool *p = &term.clusters;
+    int siz;
 
-static const unsigned char wtable[] = {
-#include "wide.h"
-};
+    if (p->len + n > p->siz)
+    {
+        tclustergc();
+        if (p->len + n > p->siz / 2 && p->siz < CLUSTER_POOL_MAX)
+        {
+            siz = MIN(MAX(2 * p->siz, 256), CLUSTER_POOL_MAX);
+            p->buf = (Rune *)xrealloc(p->buf, siz * sizeof(Rune));
+            p->siz = siz;
+        }
+        if (p->len + n > p->siz)
+            return -1;
+    }
+    p->len += n;
+    return p->len - n;
+}
+
+/*
+ * Moves the entries still used by a cell of the screen shown, or of the
+ * scrollback behind the primary one, to the front of its pool. Indices
+ * change, so every line is redrawn.
+ */
+void TerminalEmulator::tclustergc(void)
+{
+    ClusterPool *p = &term.clusters;
+    History *h = &term.hist;
+    HistPage *hp;
+    Cell *c;
+    Rune *buf;
+    int x, y, i, n, k, len = 0;
+
+    if (!p->len)
+        return;
+    buf = (Rune *)xmalloc(p->siz * sizeof(Rune));
+    for (y = 0; y < term.row; y++)
+    {
+        if (ISSHARED(term.line[y]))
+            continue;
+        for (x = 0; x < term.col; x++)
+        {
+            if (!(CELL_FLAGS(term.line[y][x]) & ATTR_CLUSTER))
+                continue;
+            i = CELL_RAW(term.line[y][x]);
+            n = p->buf[i] + 1;
+            memcpy(&buf[len], &p->buf[i], n * sizeof(Rune));
+            CELL_SETU(term.line[y][x], len);
+            len += n;
+        }
+    }
+    /* the scrollback shares the pool of the primary screen */
+    for (k = h->nspill; !IS_SET(MODE_ALTSCREEN) && k < h->npage; k++)
+    {
+        hp = HISTPAGE(h, k);
+        if (hp->packed)
+            continue;
+        c = HISTCELLS(hp);
+        for (x = k ? 0 : HISTSTART(hp, h->first); x < HISTSTART(hp, hp->nline); x++)
+        {
+            if (!(CELL_FLAGS(c[x]) & ATTR_CLUSTER))
+                continue;
+            i = CELL_RAW(c[x]);
+            n = p->buf[i] + 1;
+            memcpy(&buf[len], &p->buf[i], n * sizeof(Rune));
+            CELL_SETU(c[x], len);
+            len += n;
+        }
+    }
+    free(p->buf);
+    p->buf = buf;
+    p->len = len;
+    tfulldirt();
+}
+
+/*
+ * Encodes the glyph of c with its marks, in at most CLUSTER_MAX * UTF_SIZ
+ * bytes.
+ */
+size_t TerminalEmulator::cellencode(const Cell &c, char *s)
+{
+    const Rune *r;
+    int i, n;
+    size_t len = 0;
+
+    if (!(CELL_FLAGS(c) & ATTR_CLUSTER))
+        return utf8encode(CELL_U(c), s);
+    r = &term.clusters.buf[CELL_RAW(c)];
+    for (i = 1, n = r[0]; i <= n; i++)
+        len += utf8encode(r[i], s + len);
+    return len;
+}
+
+/*
+ * The runes of a glyph handed to the display, its base rune followed by its
+ * marks. Cluster indices are only valid until the next draw.
+ */
+const Rune *TerminalEmulator::GetCluster(const Glyph &g, int *n) const
+{
+    if (!(g.mode & ATTR_CLUSTER))
+    {
+        *n = 1;
+        return &g.u;
+    }
+    if (g.u >= (Rune)term.clusters.len)
+    {
+        *n = 0;
+        return NULL;
+    }
+    *n = term.clusters.buf[g.u];
+    return &term.clusters.buf[g.u + 1];
+}
+
+void TerminalEmulator::tputglyph(Rune u)
+{
+    int width;
+    uchar props = 0;
+    Glyph dummy;
+    Cell *gp;
+
+    if (u < 127 || !UTF8MODE())
+    {
+        width = 1;
+    }
+    else
+    {
+        props = uprops(u);
+        /* non-printable characters take no cell */
+        width = MAX((props & UPROP_WIDTH) - 1, 0);
+    }
+
+    /* marks, and whatever a zero width joiner joins, go with the glyph before */
+    if (tcombine(u, width))
+        return;
+
+    if (selected(term.c.x, term.c.y))
+        selclear();
+
+    gp = &WLINE(term.c.y)[term.c.x];
+    if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT))
+    {
+        /* on the last column, the cursor is on the first half of a wide char */
+        CELL_SETFLAG(WLINE(term.c.y)[term.col - 1], ATTR_WRAP);
+        tnewline(1);
+        gp = &WLINE(term.c.y)[term.c.x];
+    }
+
+    if (IS_SET(MODE_INSERT) && term.c.x + width < term.col)
+    {
+        memmove(gp + width, gp, (term.col - term.c.x - width) * sizeof(Cell));
+        tsetdirtspan(term.c.y, term.c.x, term.col);
+        if (ATTRCNT(term.line[term.c.y]))
+            tcountattr(term.c.y);
+    }
+
+    if (term.c.x + width > term.col)
+    {
+        /* the line goes on below, its last cell is only padding */
+        if (IS_SET(MODE_WRAP))
+            CELL_SETFLAG(*gp, ATTR_WRAP);
+        tnewline(1);
+        gp = &WLINE(term.c.y)[term.c.x];
+    }
+
+    tsetchar(u, &term.c.attr, term.c.x, term.c.y);
+    term.lastc = u;
+
+    if (width == 2)
+    {
+        CELL_SETFLAG(*gp, ATTR_WIDE);
+        if (term.c.x + 1 < term.col)
+        {
+            dummy = CELL_GLYPH(gp[1]);
+            if (dummy.mode & TRACKED_ATTR)
+                ATTRCNT(term.line[term.c.y])--;
+            dummy.mode = ATTR_WDUMMY;
+            CELL_SET(gp[1], '\0', &dummy, CELL_STYLE(&dummy));
+            tsetdirtspan(term.c.y, term.c.x + 1, term.c.x + 2);
+        }
+        if (TerminalTraits::emoji && (props & UPROP_EMOJI))
+        {
+            CELL_SETFLAG(*gp, ATTR_EMOJI);
+        }
+    }
+
+    if (term.c.x + width < term.col)
+    {
+        tmoveto(term.c.x + width, term.c.y);
+    }
+    else
+    {
+        term.c.state |= CURSOR_WRAPNEXT;
+    }
+}
+
+/*
+ * length of the run of printable ASCII (0x20 - 0x7e) at the start of s
+ */
+size_t
+asciirun(const char *s, size_t n)
+{
+    size_t i = 0;
+
+#ifdef HEXE_SSE2
+    const __m128i lo = _mm_set1_epi8(0x1f);
+    const __m128i hi = _mm_set1_epi8(0x7f);
+    __m128i v;
+    int mask;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        v = _mm_loadu_si128((const __m128i *)(s + i));
+        /* bytes >= 0x80 are negative as signed chars and fail the lower bound */
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(v, lo),
+                                               _mm_cmplt_epi8(v, hi)));
+        if (mask != 0xffff)
+            return i + ctz32(~mask);
+    }
+#endif
+    while (i < n && BETWEEN((uchar)s[i], 0x20, 0x7e))
+        i++;
+
+    return i;
+}
+
+/*
+ * Writes the run of printable ASCII at the start of s straight into the
+ * screen. Only valid in the ground state with insert mode, the printer and
+ * the graphic charset off; wrapping and dirtiness are handled once per line
+ * instead of once per character. Returns the number of bytes consumed.
+ */
+size_t
+TerminalEmulator::tputascii(const char *s, size_t len)
+{
+    size_t n, left;
+    int x, k, w, sx0, sx1, *cnt;
+    uint32_t style;
+    Cell *gp;
+
+    left = n = asciirun(s, len);
+    while (left > 0)
+    {
+        if (term.c.state & CURSOR_WRAPNEXT)
+        {
+            if (IS_SET(MODE_WRAP))
+            {
+                CELL_SETFLAG(WLINE(term.c.y)[term.col - 1], ATTR_WRAP);
+                tnewline(1);
+            }
+            else
+            {
+                /* without autowrap every char lands on the last column */
+                s += left - 1;
+                left = 1;
+            }
+        }
+
+        x = term.c.x;
+        w = MIN((int)left, term.col - x);
+        if (selspan(term.c.y, &sx0, &sx1) && sx0 < x + w && x <= sx1)
+            selclear();
+
+        /* interned per line, scrolling may have compacted the styles */
+        style = CELL_STYLE(&term.c.attr);
+        gp = &WLINE(term.c.y)[x];
+        cnt = &ATTRCNT(term.line[term.c.y]);
+        if (*cnt)
+        {
+            for (k = 0; k < w; k++)
+                *cnt -= !!(CELL_MODE(gp[k]) & TRACKED_ATTR);
+        }
+        if (term.c.attr.mode & TRACKED_ATTR)
+            *cnt += w;
+        for (k = 0; k < w; k++, gp++)
+        {
+            if (CELL_FLAGS(*gp) & ATTR_WIDE)
+            {
+                if (x + k + 1 < term.col)
+                {
+                    CELL_SETU(gp[1], ' ');
+                    CELL_CLRFLAG(gp[1], ATTR_WDUMMY);
+                }
+            }
+            else if ((CELL_FLAGS(*gp) & ATTR_WDUMMY) && x + k > 0)
+            {
+                CELL_SETU(gp[-1], ' ');
+                CELL_CLRFLAG(gp[-1], ATTR_WIDE | ATTR_CLUSTER);
+            }
+            CELL_SET(*gp, (uchar)s[k], &term.c.attr, style);
+        }
+        tsetdirtspan(term.c.y, MAX(x - 1, 0), MIN(x + w + 1, term.col));
+        s += w;
+        left -= w;
+
+        if (x + w < term.col)
+        {
+            tmoveto(x + w, term.c.y);
+        }
+        else
+        {
+            term.c.x = term.col - 1;
+            term.c.state |= CURSOR_WRAPNEXT;
+        }
+    }
+    term.lastc = (uchar)s[-1];
+
+    return n;
+}
 
-static int Hexe_wcwidth(Rune wc)
+/*
+ * TUIs and colored output repeat a handful of SGR sequences, so the effect
+ * of each is cached by its parameter bytes. Handles the SGR sequence at the
+ * start of s and returns its length, or 0 if s does not start with one that
+ * fits a cache key.
+ */
+size_t
+TerminalEmulator::tputsgr(const char *s, size_t len)
 {
-    if (wc < 0xffU)
-        return (wc + 1 & 0x7f) >= 0x21 ? 1 : wc ? -1 : 0;
+    size_t i, n;
+    uint32_t h = 0x811C9DC5u;
+    SGRCache *e;
 
-    if (is_emoji(wc))
-        return 2;
-
-    if ((wc & 0xfffeffffU) < 0xfffe)
+    if (len < 3 || s[1] != '[')
+        return 0;
+    for (i = 2; i < len && i < SGR_KEY_SIZ + 2; i++)
     {
-        if ((table[table[wc >> 8] * 32 + ((wc & 255) >> 3)] >> (wc & 7)) & 1)
+        if (s[i] == 'm')
+            break;
+        if (!BETWEEN(s[i], '0', '9') && s[i] != ';' && s[i] != ':')
             return 0;
-        if ((wtable[wtable[wc >> 8] * 32 + ((wc & 255) >> 3)] >> (wc & 7)) & 1)
-            return 2;
-        return 1;
+        h = (h ^ (uchar)s[i]) * 0x01000193u;
     }
-
-    if ((wc & 0xfffe) == 0xfffe)
-        return -1;
-    if (wc - 0x20000U < 0x20000)
-        return 2;
-    if (wc == 0xe0001 || wc - 0xe0020U < 0x5f || wc - 0xe0100 < 0xef)
+    if (i == len || s[i] != 'm')
         return 0;
 
-    return 1;
+    n = i - 2;
+    e = &sgrcache[(h ^ (h >> 16)) & (SGR_CACHE_SIZ - 1)];
+    if (e->len == (int)n + 1 && !memcmp(e->key, s + 2, n))
+    {
+        tsgrapply(&e->d);
+        return n + 3;
+    }
+
+    /* not seen yet, take the usual path and remember the outcome */
+    sgrok = 0;
+    for (i = 0; i < n + 3; i++)
+        tputc((uchar)s[i]);
+    if (sgrok)
+    {
+        e->len = n + 1;
+        memcpy(e->key, s + 2, n);
+        e->d = sgrlast;
+    }
+    return n + 3;
 }
 
-void TerminalEmulator::tputc(Rune u)
+int TerminalEmulator::twrite(const char *buf, int buflen, int show_ctrl)
 {
-    char c[UTF_SIZ];
-    int control;
-    int width;
-    size_t len;
-    Glyph *gp;
+    Rune runes[UTF_BATCH];
+    uchar lens[UTF_BATCH];
+    size_t n, i, k, nr, used;
+    int utf8;
+    Rune u;
 
-    control = ISCONTROL(u);
-    if (u < 127 || !IS_SET(MODE_UTF8))
-    {
-        c[0] = u;
-        width = (int)(len = 1);
-    }
-    else
+    show_ctrl = TerminalTraits::showctrl && show_ctrl;
+
+    for (n = 0; n < (size_t)buflen;)
     {
-        len = utf8encode(u, c);
-        //if (!control && (width = wcwidth9(u)) < 0) {
-        if (!control && (width = Hexe_wcwidth(u)) < 0)
+        utf8 = UTF8MODE();
+        if (utf8)
+        {
+            nr = utf8decodebatch(buf + n, buflen - n, runes, lens, LEN(runes), &used);
+            /* an incomplete utf8 char is left for the next call */
+            if (nr == 0)
+                break;
+        }
+        else
         {
-            if (width == -1)
+            nr = MIN(buflen - n, LEN(runes));
+            for (i = 0; i < nr; i++)
             {
-                width = 0;
+                runes[i] = buf[n + i] & 0xFF;
+                lens[i] = 1;
             }
-            else
+        }
+
+        for (i = 0; i < nr;)
+        {
+            u = runes[i];
+            if (term.esc == ESC_GROUND && BETWEEN(u, 0x20, 0x7e) &&
+                !IS_SET(MODE_INSERT) && !PRINTING() &&
+                term.trantbl[term.charset] != CS_GRAPHIC0)
+            {
+                /* ASCII runes are single bytes, so take the run from buf */
+                k = tputascii(buf + n, nr - i);
+                n += k;
+                i += k;
+                continue;
+            }
+
+            /* the runes of an SGR sequence are single bytes too */
+            if (u == '\033' && term.esc == ESC_GROUND && !show_ctrl &&
+                !PRINTING() && (k = tputsgr(buf + n, nr - i)) > 0)
+            {
+                n += k;
+                i += k;
+                continue;
+            }
+
+            /* a run of short lines scrolls once instead of per line */
+            if (u == '\n' && term.esc == ESC_GROUND && term.c.y == term.bot &&
+                !show_ctrl && !PRINTING())
+            {
+                k = tscrollahead(buf + n, buflen - n);
+                if (k > 1)
+                {
+                    tscrollup(term.top, k);
+                    tmoveto(term.c.x, term.bot - k);
+                }
+            }
+
+            if (show_ctrl && ISCONTROL(u))
             {
-                width = 1;
+                if (u & 0x80)
+                {
+                    u &= 0x7f;
+                    tputc('^');
+                    tputc('[');
+                }
+                else if (u != '\n' && u != '\r' && u != '\t')
+                {
+                    u ^= 0x40;
+                    tputc('^');
+                }
             }
+            tputc(u);
+            n += lens[i++];
+
+            /* the rest of the batch was decoded in the wrong mode */
+            if (UTF8MODE() != utf8)
+                break;
         }
     }
+    return (int)n;
+}
 
-    if (IS_SET(MODE_PRINT))
-        tprinter(c, len);
+#ifdef HEXE_COMPACT_CELLS
+static inline uint32_t
+stylehash(const Glyph *g)
+{
+    uint32_t h;
 
-    /*
-	 * STR sequence must be checked before anything else
-	 * because it uses all following characters until it
-	 * receives a ESC, a SUB, a ST or any other C1 control
-	 * character.
-	 */
-    if (term.esc & ESC_STR)
-    {
-        if (u == '\a' || u == 030 || u == 032 || u == 033 ||
-            ISCONTROLC1(u))
-        {
-            term.esc &= ~(ESC_START | ESC_STR);
-            term.esc |= ESC_STR_END;
-            goto check_control_code;
-        }
+    h = (g->mode * 0x9E3779B1u) ^ g->fg;
+    h = (h * 0x85EBCA6Bu) ^ g->bg;
+    h *= 0xC2B2AE35u;
+    return h ^ (h >> 16);
+}
 
-        if (strescseq.len + len >= strescseq.siz)
-        {
-            /*
-			 * Here is a bug in terminals. If the user never sends
-			 * some code to stop the str or esc command, then st
-			 * will stop responding. But this is better than
-			 * silently failing with unknown characters. At least
-			 * then users will report back.
-			 *
-			 * In the case users ever get fixed, here is the code:
-			 */
-            /*
-			 * term.esc = 0;
-			 * strhandle();
-			 */
-            if (strescseq.siz > (SIZE_MAX - UTF_SIZ) / 2)
-                return;
-            strescseq.siz *= 2;
-            strescseq.buf = (char *)xrealloc(strescseq.buf, strescseq.siz);
-        }
+/*
+ * Returns the index of the style (mode without layout flags, fg, bg) of g,
+ * interning it if needed. The table is garbage collected when it fills up,
+ * which renumbers the styles, so indices must not be held across calls that
+ * may intern.
+ */
+uint32_t TerminalEmulator::tstyle(const Glyph *g)
+{
+    Glyph key;
+    uint32_t i, mask;
 
-        memmove(&strescseq.buf[strescseq.len], c, len);
-        strescseq.len += len;
-        return;
-    }
+    key.u = 0;
+    key.mode = g->mode & ~CELL_LAYOUT;
+    key.fg = g->fg;
+    key.bg = g->bg;
 
-check_control_code:
-    /*
-	 * Actions of control codes must be performed as soon they arrive
-	 * because they can be embedded inside a control sequence, and
-	 * they must not cause conflicts with sequences.
-	 */
-    if (control)
+    /* runs of text mostly share one attribute */
+    if (term.nstyles > 0 && !ATTRCMP(key, term.lastattr))
+        return term.laststyle;
+
+    if (term.nstyles == term.stylecap)
+        tstylegc();
+
+    mask = 2 * term.stylecap - 1;
+    for (i = stylehash(&key) & mask; term.stylemap[i]; i = (i + 1) & mask)
     {
-        tcontrolcode(u);
-        /*
-		 * control codes are not shown ever
-		 */
-        if (!term.esc)
-            term.lastc = 0;
-        return;
+        if (!ATTRCMP(term.styles[term.stylemap[i] - 1], key))
+            break;
+    }
+    if (!term.stylemap[i])
+    {
+        term.styles[term.nstyles++] = key;
+        term.stylemap[i] = term.nstyles;
     }
-    else if (term.esc & ESC_START)
+
+    term.lastattr = key;
+    term.laststyle = term.stylemap[i] - 1;
+    return term.laststyle;
+}
+
+/*
+ * Drops the styles no cell of either screen or of the scrollback uses and
+ * renumbers the rest, doubling the table while it would stay more than
+ * half full.
+ */
+void TerminalEmulator::tstylegc(void)
+{
+    uint32_t *live, i, n, cap, mask;
+    CellLine *screen, b;
+    History *h = &term.hist;
+    HistPage *hp;
+    Cell *c;
+    int s, x, y;
+
+    live = (uint32_t *)xmalloc(MAX(term.nstyles, 1) * sizeof(uint32_t));
+    memset(live, 0, MAX(term.nstyles, 1) * sizeof(uint32_t));
+
+    /*
+     * rows handed out by tresize are only cleared after their style is
+     * interned, so out of range indices are skipped rather than trusted
+     */
+    for (s = 0; s < 2; s++)
     {
-        if (term.esc & ESC_CSI)
+        screen = s ? term.alt : term.line;
+        for (y = 0; screen && y < term.row; y++)
         {
-            csiescseq.buf[csiescseq.len++] = u;
-            if (BETWEEN(u, 0x40, 0x7E) || csiescseq.len >= sizeof(csiescseq.buf) - 1)
+            if (ISSHARED(screen[y]))
+                continue;
+            for (x = 0; x < term.col; x++)
             {
-                term.esc = 0;
-                csiparse();
-                csihandle();
+                if (screen[y][x].style < term.nstyles)
+                    live[screen[y][x].style] = 1;
             }
-            return;
         }
-        else if (term.esc & ESC_UTF8)
+    }
+    for (s = 0; s < BLANK_ROWS; s++)
+    {
+        b = term.blank + s * term.stride;
+        if (term.blankref[s] && b[0].style < term.nstyles)
+            live[b[0].style] = 1;
+    }
+    for (s = h->nspill; s < h->npage; s++)
+    {
+        hp = HISTPAGE(h, s);
+        if (hp->packed)
+            continue;
+        c = HISTCELLS(hp);
+        for (x = 0; x < HISTSTART(hp, hp->nline); x++)
         {
-            tdefutf8(u);
+            if (c[x].style < term.nstyles)
+                live[c[x].style] = 1;
         }
-        else if (term.esc & ESC_ALTCHARSET)
+    }
+
+    for (i = n = 0; i < term.nstyles; i++)
+    {
+        if (live[i])
         {
-            tdeftran(u);
+            term.styles[n] = term.styles[i];
+            live[i] = n++;
         }
-        else if (term.esc & ESC_TEST)
+    }
+
+    for (s = 0; s < 2; s++)
+    {
+        screen = s ? term.alt : term.line;
+        for (y = 0; screen && y < term.row; y++)
         {
-            tdectest(u);
+            if (ISSHARED(screen[y]))
+                continue;
+            for (x = 0; x < term.col; x++)
+            {
+                i = screen[y][x].style;
+                screen[y][x].style = i < term.nstyles ? live[i] : 0;
+            }
         }
-        else
+    }
+    /* blank rows are shared by several lines, so they are renumbered once */
+    for (s = 0; s < BLANK_ROWS; s++)
+    {
+        b = term.blank + s * term.stride;
+        i = b[0].style;
+        b[0].style = i < term.nstyles ? live[i] : 0;
+        cellfill(b, b[0], term.stride);
+    }
+    for (s = h->nspill; s < h->npage; s++)
+    {
+        hp = HISTPAGE(h, s);
+        if (hp->packed)
+            continue;
+        c = HISTCELLS(hp);
+        for (x = 0; x < HISTSTART(hp, hp->nline); x++)
         {
-            if (!eschandle(u))
-                return;
-            /* sequence already finished */
+            i = c[x].style;
+            c[x].style = i < term.nstyles ? live[i] : 0;
         }
-        term.esc = 0;
-        /*
-		 * All characters which form part of a sequence are not
-		 * printed
-		 */
-        return;
     }
-    if (selected(term.c.x, term.c.y))
-        selclear();
+    free(live);
 
-    gp = &term.line[term.c.y][term.c.x];
-    if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT))
+    cap = MAX(term.stylecap, STYLE_INIT);
+    while (n > cap / 2)
+        cap *= 2;
+    if (cap != term.stylecap)
     {
-        gp->mode |= ATTR_WRAP;
-        tnewline(1);
-        gp = &term.line[term.c.y][term.c.x];
+        term.styles = (Glyph *)xrealloc(term.styles, cap * sizeof(Glyph));
+        term.stylemap = (uint32_t *)xrealloc(term.stylemap, 2 * cap * sizeof(uint32_t));
+        term.stylecap = cap;
     }
 
-    if (IS_SET(MODE_INSERT) && term.c.x + width < term.col)
-        memmove(gp + width, gp, (term.col - term.c.x - width) * sizeof(Glyph));
-
-    if (term.c.x + width > term.col)
+    mask = 2 * cap - 1;
+    memset(term.stylemap, 0, 2 * cap * sizeof(uint32_t));
+    for (term.nstyles = 0; term.nstyles < n; term.nstyles++)
     {
-        tnewline(1);
-        gp = &term.line[term.c.y][term.c.x];
+        for (i = stylehash(&term.styles[term.nstyles]) & mask; term.stylemap[i]; i = (i + 1) & mask)
+            /* nothing */;
+        term.stylemap[i] = term.nstyles + 1;
     }
 
-    tsetchar(u, &term.c.attr, term.c.x, term.c.y);
-    term.lastc = u;
+    /* the cached style may have been renumbered */
+    term.lastattr.mode = (ushort)~0;
+}
 
-    if (width == 2)
+Glyph TerminalEmulator::cellglyph(const Cell &c)
+{
+    Glyph g = term.styles[c.style];
+
+    /* the display looks clusters up by their index */
+    g.u = CELL_RAW(c);
+    g.mode |= CELL_FLAGS(c);
+    return g;
+}
+#endif
+
+/*
+ * Moves the first minrow lines of each screen into a new slab of nrows rows
+ * of stride cells, keeping mincol cells of each. Lines pointing at a blank
+ * row keep pointing at it.
+ */
+void TerminalEmulator::tnewslab(int stride, int nrows, int minrow, int mincol)
+{
+    int i, k, n, s;
+    size_t rowsiz = stride * sizeof(Cell);
+    void *mem;
+    Cell *slab, *blank, zero;
+    CellLine *screen;
+
+    mem = xmalloc((nrows + BLANK_ROWS) * rowsiz + nrows + SLAB_ALIGN - 1);
+    slab = (Cell *)(((uintptr_t)mem + SLAB_ALIGN - 1) & ~(uintptr_t)(SLAB_ALIGN - 1));
+    blank = slab + nrows * stride;
+
+    /* a zeroed cell is never a blank, so unused blank rows match nothing */
+    memset(&zero, 0, sizeof(zero));
+    for (k = 0; k < BLANK_ROWS; k++)
+        cellfill(blank + k * stride, term.blank ? term.blank[k * term.stride] : zero, stride);
+    for (s = n = 0; s < 2; s++)
     {
-        gp->mode |= ATTR_WIDE;
-        if (term.c.x + 1 < term.col)
+        screen = s ? term.alt : term.line;
+        for (i = 0; screen && i < minrow; i++)
         {
-            gp[1].u = '\0';
-            gp[1].mode = ATTR_WDUMMY;
+            if (ISSHARED(screen[i]))
+            {
+                screen[i] = blank + BLANKIDX(screen[i]) * stride;
+            }
+            else
+            {
+                memcpy(slab + n * stride, screen[i], mincol * sizeof(Cell));
+                screen[i] = slab + n++ * stride;
+            }
         }
-        if (is_emoji(u))
+    }
+    free(term.slabmem);
+    term.slabmem = mem;
+    /* recounted by tresize once the lines are in place */
+    term.attrcnt = (int *)xrealloc(term.attrcnt, (nrows + BLANK_ROWS) * sizeof(int));
+    memset(term.attrcnt, 0, (nrows + BLANK_ROWS) * sizeof(int));
+    term.freerows = (int *)xrealloc(term.freerows, nrows * sizeof(int));
+    term.slab = slab;
+    term.blank = blank;
+    term.stride = stride;
+    term.slabrows = nrows;
+}
+
+/*
+ * Both screens take their rows from one cache-aligned slab. Capacity grows
+ * geometrically and is only given back with the alternate screen, so
+ * dragging a window edge only reallocates when it passes the largest size
+ * seen so far. The first minrow rows of each screen are kept, the rest
+ * point at a blank row until tresize clears them. Slab rows are only
+ * touched once a line is written, so the pages of a mostly blank screen
+ * are never faulted in.
+ */
+void TerminalEmulator::tallocrows(int col, int row, int minrow)
+{
+    int i, k, stride, nrows;
+    int need = term.alt ? 2 * row : row;
+    CellLine *screen;
+    uchar *used;
+
+    if (col > term.stride || need > term.slabrows)
+    {
+        stride = term.stride;
+        if (col > stride)
         {
-            gp->mode |= ATTR_EMOJI;
+            stride = MAX(col, stride + stride / 2);
+            stride = DIVCEIL(stride, SLAB_ALIGN / (int)sizeof(Cell)) * (SLAB_ALIGN / sizeof(Cell));
         }
+        nrows = term.slabrows;
+        if (need > nrows)
+            nrows = MAX(need, nrows + nrows / 2);
+        tnewslab(stride, nrows, minrow, MIN(col, term.col));
     }
 
-    if (term.c.x + width < term.col)
+    /* the lines past minrow are cleared by tresize, which shares them */
+    for (i = minrow; i < row; i++)
     {
-        tmoveto(term.c.x + width, term.c.y);
+        term.line[i] = term.blank;
+        if (term.alt)
+            term.alt[i] = term.blank;
     }
-    else
+
+    memset(term.blankref, 0, sizeof(term.blankref));
+    used = (uchar *)(term.blank + BLANK_ROWS * term.stride);
+    memset(used, 0, term.slabrows);
+    for (k = 0; k < 2; k++)
     {
-        term.c.state |= CURSOR_WRAPNEXT;
+        screen = k ? term.alt : term.line;
+        for (i = 0; screen && i < row; i++)
+        {
+            if (ISSHARED(screen[i]))
+                term.blankref[BLANKIDX(screen[i])]++;
+            else
+                used[(screen[i] - term.slab) / term.stride] = 1;
+        }
+    }
+
+    /* the lowest free rows come first, the pages past them stay untouched */
+    term.nfree = 0;
+    for (i = term.slabrows - 1; i >= 0; i--)
+    {
+        if (!used[i])
+            term.freerows[term.nfree++] = i;
     }
 }
 
-int TerminalEmulator::twrite(const char *buf, int buflen, int show_ctrl)
+/*
+ * The primary screen joined back into the lines its rows were soft wrapped
+ * from, while tresize lays it out at another width. Cursor k of the screen
+ * is off[k] cells into line at[k].
+ */
+static struct
 {
-    size_t charsize;
-    Rune u;
-    size_t n;
+    Glyph *buf;
+    int *end; /* of each line in buf */
+    int n;
+    int at[2];
+    int off[2];
+} unwrapped;
+
+/* joins the rows of the primary screen at their soft wraps, before a resize */
+void TerminalEmulator::tunwrap(void)
+{
+    CellLine *screen = IS_SET(MODE_ALTSCREEN) ? term.alt : term.line;
+    const TCursor *cur[2];
+    Glyph g, *dst;
+    Cell blank, *end;
+    int x, y, k, n, len, start, last, wrap;
+
+    cur[0] = IS_SET(MODE_ALTSCREEN) ? NULL : &term.c;
+    cur[1] = &term.saved[0];
+    unwrapped.n = 0;
+    unwrapped.at[0] = unwrapped.at[1] = -1;
+    if (!screen)
+        return;
+
+    memset(&g, 0, sizeof(g));
+    g.fg = defaultfg;
+    g.bg = defaultbg;
+    CELL_SET(blank, ' ', &g, CELL_STYLE(&g));
 
-    for (n = 0; n < buflen; n += charsize)
+    /* the blank rows past the last written one and the cursors go */
+    for (last = -1, y = 0; y < term.row; y++)
     {
-        if (IS_SET(MODE_UTF8))
+        if (celltrim(screen[y], blank, term.col))
+            last = y;
+    }
+    for (k = 0; k < 2; k++)
+    {
+        if (cur[k])
+            last = MAX(last, MIN(cur[k]->y, term.row - 1));
+    }
+    if (last < 0)
+        return;
+
+    unwrapped.buf = (Glyph *)xrealloc(unwrapped.buf, (last + 1) * term.col * sizeof(Glyph));
+    unwrapped.end = (int *)xrealloc(unwrapped.end, (last + 1) * sizeof(int));
+    for (len = start = y = 0; y <= last; y++)
+    {
+        wrap = y < last && CELL_FLAGS(screen[y][term.col - 1]) & ATTR_WRAP;
+        x = wrap ? term.col : celltrim(screen[y], blank, term.col);
+
+        /* the blank left before a wide char that did not fit is padding */
+        end = &screen[y][term.col - 1];
+        if (wrap && CELL_FLAGS(screen[y + 1][0]) & ATTR_WIDE &&
+            CELL_RAW(*end) == ' ' && !(CELL_FLAGS(*end) & ATTR_CLUSTER))
+            x--;
+
+        /* a cursor past the end keeps the blanks before it */
+        for (k = 0; k < 2; k++)
         {
-            /* process a complete utf8 char */
-            charsize = utf8decode(buf + n, &u, buflen - n);
-            if (charsize == 0)
-                break;
+            if (!cur[k] || cur[k]->y != y)
+                continue;
+            n = MIN(cur[k]->x + !!(cur[k]->state & CURSOR_WRAPNEXT), term.col);
+            x = MAX(x, n);
+            unwrapped.at[k] = unwrapped.n;
+            unwrapped.off[k] = len - start + n;
         }
-        else
+
+        dst = unwrapped.buf + len;
+        for (k = 0; k < x; k++)
         {
-            u = buf[n] & 0xFF;
-            charsize = 1;
+            dst[k] = CELL_GLYPH(screen[y][k]);
+            dst[k].mode &= ~ATTR_WRAP;
         }
-        if (show_ctrl && ISCONTROL(u))
+        len += x;
+        if (!wrap)
+        {
+            unwrapped.end[unwrapped.n++] = len;
+            start = len;
+        }
+    }
+}
+
+/*
+ * Lays the lines joined by tunwrap out again at the new width, from the
+ * top of the primary screen. The rows that no longer fit above its cursor
+ * go to the scrollback.
+ */
+void TerminalEmulator::trewrap(void)
+{
+    int alt = IS_SET(MODE_ALTSCREEN);
+    TCursor *cur[2];
+    CellLine line;
+    const Glyph *src;
+    Glyph g;
+    Cell blank;
+    int i, j, k, s, x, y, q, off, siz, nrow, top, row[2], col[2];
+
+    if (alt)
+        tswapscreen();
+    cur[0] = alt ? NULL : &term.c;
+    cur[1] = &term.saved[0];
+
+    /* the rows of each line, and the ones the cursors land on */
+    row[0] = row[1] = -1;
+    for (nrow = i = 0; i < unwrapped.n; i++)
+    {
+        s = i ? unwrapped.end[i - 1] : 0;
+        siz = unwrapped.end[i] - s;
+        for (off = 0;; off += k)
         {
-            if (u & 0x80)
+            k = histrow(unwrapped.buf + s + off, siz - off, term.col);
+            for (j = 0; j < 2; j++)
             {
-                u &= 0x7f;
-                tputc('^');
-                tputc('[');
+                if (unwrapped.at[j] == i && row[j] < 0 && (unwrapped.off[j] < off + k || off + k >= siz))
+                {
+                    row[j] = nrow;
+                    col[j] = unwrapped.off[j] - off;
+                }
             }
-            else if (u != '\n' && u != '\r' && u != '\t')
+            nrow++;
+            if (off + k >= siz)
+                break;
+        }
+    }
+
+    /* as much as fits is kept below the cursor */
+    j = cur[0] ? 0 : 1;
+    top = MIN(MAX(nrow - term.row, 0), MAX(row[j], 0));
+
+    memset(&g, 0, sizeof(g));
+    g.fg = defaultfg;
+    g.bg = defaultbg;
+    CELL_SET(blank, ' ', &g, CELL_STYLE(&g));
+
+    for (q = i = 0; i < unwrapped.n; i++)
+    {
+        s = i ? unwrapped.end[i - 1] : 0;
+        siz = unwrapped.end[i] - s;
+        for (off = 0;; off += k)
+        {
+            k = histrow(unwrapped.buf + s + off, siz - off, term.col);
+            y = q < top ? 0 : q - top;
+            if (y < term.row)
             {
-                u ^= 0x40;
-                tputc('^');
+                line = WLINE(y);
+                src = unwrapped.buf + s + off;
+                for (x = 0; x < k; x++)
+                    CELL_SET(line[x], src[x].u, &src[x], CELL_STYLE(&src[x]));
+                cellfill(line + k, blank, term.col - k);
+                if (off + k < siz)
+                    CELL_SETFLAG(line[term.col - 1], ATTR_WRAP);
+                tcountattr(y);
+                if (q < top)
+                    thpush(1);
             }
+            q++;
+            if (off + k >= siz)
+                break;
         }
-        tputc(u);
     }
-    return (int)n;
+    for (y = nrow - top; y < term.row; y++)
+        tclearregion(0, y, term.col - 1, y);
+
+    for (j = 0; j < 2; j++)
+    {
+        if (!cur[j] || row[j] < 0)
+            continue;
+        cur[j]->x = MIN(col[j], term.col - 1);
+        cur[j]->y = MIN(MAX(row[j] - top, 0), term.row - 1);
+        if (col[j] >= term.col)
+            cur[j]->state |= CURSOR_WRAPNEXT;
+        else
+            cur[j]->state &= ~CURSOR_WRAPNEXT;
+    }
+
+    tfulldirt();
+    if (alt)
+        tswapscreen();
 }
 
 void TerminalEmulator::tresize(int col, int row)
 {
-    int i;
+    int i, j;
     int minrow = MIN(row, term.row);
     int mincol = MIN(col, term.col);
-    int *bp;
+    int *bp, reflow;
     TCursor c;
 
     if (col < 1 || row < 1)
@@ -2370,47 +6467,53 @@ void TerminalEmulator::tresize(int col, int row)
         return;
     }
 
+    tlinearize();
+
+    /* soft wrapped lines are joined before their rows lose columns */
+    reflow = term.col && col != term.col;
+    if (reflow)
+    {
+        selclear();
+        tunwrap();
+    }
+
     /*
 	 * slide screen to keep cursor where we expect it -
 	 * tscrollup would work here, but we can optimize to
-	 * memmove because we're freeing the earlier lines
+	 * memmove because the earlier lines are dropped
 	 */
-    for (i = 0; i <= term.c.y - row; i++)
-    {
-        free(term.line[i]);
-        free(term.alt[i]);
-    }
+    i = MAX(term.c.y - row + 1, 0);
     /* ensure that both src and dst are not NULL */
     if (i > 0)
     {
-        memmove(term.line, term.line + i, row * sizeof(Line));
-        memmove(term.alt, term.alt + i, row * sizeof(Line));
-    }
-    for (i += row; i < term.row; i++)
-    {
-        free(term.line[i]);
-        free(term.alt[i]);
+        if (!IS_SET(MODE_ALTSCREEN) && !reflow)
+            thpush(i);
+        memmove(term.line, term.line + i, row * sizeof(CellLine));
+        if (term.alt)
+            memmove(term.alt, term.alt + i, row * sizeof(CellLine));
     }
 
     /* resize to new height */
-    term.line = (Line *)xrealloc(term.line, row * sizeof(Line));
-    term.alt = (Line *)xrealloc(term.alt, row * sizeof(Line));
-    term.dirty = (int *)xrealloc(term.dirty, row * sizeof(*term.dirty));
-    term.tabs = (int *)xrealloc(term.tabs, col * sizeof(*term.tabs));
-
-    /* resize each row to new width, zero-pad if needed */
-    for (i = 0; i < minrow; i++)
+    term.ring = (CellLine *)xrealloc(term.ring, 2 * row * sizeof(CellLine));
+    term.line = term.ring;
+    if (term.alt)
     {
-        term.line[i] = (Line)xrealloc(term.line[i], col * sizeof(Glyph));
-        term.alt[i] = (Line)xrealloc(term.alt[i], col * sizeof(Glyph));
+        term.altring = (CellLine *)xrealloc(term.altring, 2 * row * sizeof(CellLine));
+        term.alt = term.altring;
     }
-
-    /* allocate any new rows */
-    for (/* i = minrow */; i < row; i++)
+    term.dirty = (DirtySpan *)xrealloc(term.dirty, row * sizeof(*term.dirty));
+    for (i = minrow; i < row; i++)
     {
-        term.line[i] = (Line)xmalloc(col * sizeof(Glyph));
-        term.alt[i] = (Line)xmalloc(col * sizeof(Glyph));
+        term.dirty[i].x1 = col;
+        term.dirty[i].x2 = 0;
     }
+    term.tabs = (int *)xrealloc(term.tabs, col * sizeof(*term.tabs));
+    term.drawbuf = (Glyph *)xrealloc(term.drawbuf, col * sizeof(Glyph));
+
+    tallocrows(col, row, minrow);
+    memcpy(term.ring + row, term.ring, row * sizeof(CellLine));
+    if (term.alt)
+        memcpy(term.altring + row, term.altring, row * sizeof(CellLine));
     if (col > term.col)
     {
         bp = term.tabs + term.col;
@@ -2424,6 +6527,8 @@ void TerminalEmulator::tresize(int col, int row)
     /* update terminal size */
     term.col = col;
     term.row = row;
+    if (term.hist.cols != col)
+        thresize(col);
     /* reset scrolling region */
     tsetscroll(0, row - 1);
     /* make use of the LIMIT in tmoveto */
@@ -2440,10 +6545,17 @@ void TerminalEmulator::tresize(int col, int row)
         {
             tclearregion(0, minrow, col - 1, row - 1);
         }
+        /* kept lines may have lost columns or moved to another slab row */
+        for (j = 0; j < minrow; j++)
+            tcountattr(j);
+        if (!term.alt)
+            break;
         tswapscreen();
         tcursor(CURSOR_LOAD);
     }
     term.c = c;
+    if (reflow)
+        trewrap();
 }
 
 void TerminalEmulator::resettitle(void)
@@ -2455,22 +6567,57 @@ void TerminalEmulator::resettitle(void)
 
 void TerminalEmulator::drawregion(TerminalDisplay &dpy, int x1, int y1, int x2, int y2)
 {
-    int y;
+    int y, dx1, dx2;
+#ifdef HEXE_COMPACT_CELLS
+    int x;
+#endif
 
-    for (y = y1; y < y2; y++)
+    /* with history shown, line y is drawn term.scr rows down */
+    for (y = y1; y < y2 && y + term.scr < term.row; y++)
     {
-        if (!term.dirty[y])
+        /* only the damaged columns are sent */
+        dx1 = MAX(term.dirty[y].x1, x1);
+        dx2 = MIN(term.dirty[y].x2, x2);
+        if (dx1 >= dx2)
             continue;
 
-        term.dirty[y] = 0;
+        term.dirty[y].x1 = term.col;
+        term.dirty[y].x2 = 0;
+
+#ifdef HEXE_COMPACT_CELLS
+        /* the display takes full glyphs */
+        for (x = dx1; x < dx2; x++)
+            term.drawbuf[x] = cellglyph(term.line[y][x]);
+        dpy.DrawLine(term.drawbuf, dx1, y + term.scr, dx2);
+#else
+        dpy.DrawLine(term.line[y], dx1, y + term.scr, dx2);
+#endif
+    }
+}
+
+/* draws the history lines shown above the screen, padded with blanks */
+void TerminalEmulator::drawhistory(TerminalDisplay &dpy)
+{
+    Glyph g;
+    int x, y;
+
+    g.u = ' ';
+    g.mode = ATTR_NULL;
+    g.fg = defaultfg;
+    g.bg = defaultbg;
 
-        dpy.DrawLine(term.line[y], x1, y, x2);
+    for (y = 0; y < MIN(term.scr, term.row); y++)
+    {
+        for (x = thline(term.scr - y, term.drawbuf); x < term.col; x++)
+            term.drawbuf[x] = g;
+        dpy.DrawLine(term.drawbuf, 0, y, term.col);
     }
 }
 
 void TerminalEmulator::draw(void)
 {
     int cx = term.c.x, ocx = term.ocx, ocy = term.ocy;
+    int scr;
 
     {
         auto dpy = m_dpy.lock();
@@ -2479,17 +6626,32 @@ void TerminalEmulator::draw(void)
 
         dpy->DrawBegin(term.col, term.row);
 
+        /* a scrolled back view keeps its lines while new ones are pushed */
+        scr = dpy->GetScrollOffset();
+        if (scr > 0)
+            scr += (int)MIN(term.hist.npushed - term.hdrawn, (uint)term.hist.nrows);
+        scr = IS_SET(MODE_ALTSCREEN) ? 0 : MIN(scr, term.hist.nrows);
+        if (scr != dpy->GetScrollOffset())
+            dpy->SetScrollOffset(scr);
+        if (scr != term.scr || (scr > 0 && term.hist.npushed != term.hdrawn))
+        {
+            term.scr = scr;
+            tfulldirt();
+            drawhistory(*dpy);
+        }
+        term.hdrawn = term.hist.npushed;
+
         /* adjust cursor position */
         LIMIT(term.ocx, 0, term.col - 1);
         LIMIT(term.ocy, 0, term.row - 1);
-        if (term.line[term.ocy][term.ocx].mode & ATTR_WDUMMY)
+        if (term.ocx > 0 && CELL_FLAGS(term.line[term.ocy][term.ocx]) & ATTR_WDUMMY)
             term.ocx--;
-        if (term.line[term.c.y][cx].mode & ATTR_WDUMMY)
+        if (cx > 0 && CELL_FLAGS(term.line[term.c.y][cx]) & ATTR_WDUMMY)
             cx--;
 
         drawregion(*dpy, 0, 0, term.col, term.row);
-        dpy->DrawCursor(cx, term.c.y, term.line[term.c.y][cx],
-                        term.ocx, term.ocy, term.line[term.ocy][term.ocx]);
+        dpy->DrawCursor(cx, term.c.y + term.scr, CELL_GLYPH(term.line[term.c.y][cx]),
+                        term.ocx, term.ocy + term.scr, CELL_GLYPH(term.line[term.ocy][term.ocx]));
         term.ocx = cx;
         term.ocy = term.c.y;
 
@@ -2501,6 +6663,8 @@ void TerminalEmulator::draw(void)
 
 void TerminalEmulator::Redraw()
 {
+    /* so are the history lines shown */
+    term.scr = -1;
     tfulldirt();
     draw();
 }
@@ -2533,8 +6697,10 @@ TerminalEmulator::TerminalEmulator(PtyPtr &&pty, ProcPtr &&process, const std::s
     memset(m_buf, 0, sizeof(m_buf));
     memset(&term, 0, sizeof(term));
     memset(&sel, 0, sizeof(sel));
+    memset(&srch, 0, sizeof(srch));
     memset(&csiescseq, 0, sizeof(csiescseq));
     memset(&strescseq, 0, sizeof(strescseq));
+    memset(sgrcache, 0, sizeof(sgrcache));
 
     int col = m_pty->GetNumColumns();
     int row = m_pty->GetNumRows();
@@ -2557,6 +6723,10 @@ TerminalEmulator::~TerminalEmulator()
         if (dpy)
             dpy->Detach(this);
     }
+    SearchCancel();
+    thclear();
+    histclose(&term.hist);
+    free(term.hist.pages);
     m_process->Terminate();
 }
 
@@ -2645,8 +6815,22 @@ void TerminalEmulator::Update()
 
     // TODO: Handle blink
 
+    /* lines past the hot window of the scrollback are packed between reads */
+    thpack();
+
+    /* hold back a synchronized update until it ends or times out */
+    if (IS_SET(MODE_SYNC) &&
+        std::chrono::steady_clock::now() - m_syncStart >= std::chrono::milliseconds(synctimeout))
+        term.mode &= ~MODE_SYNC;
+
     // TODO: Do not draw every update
-    draw();
+    if (!IS_SET(MODE_SYNC))
+        draw();
+
+    /* shells rarely show the alternate screen, its rows are given back */
+    if (term.alt && !IS_SET(MODE_ALTSCREEN) &&
+        std::chrono::steady_clock::now() - m_altLeft >= std::chrono::milliseconds(altreleasetimeout))
+        taltfree();
 
     m_process->CheckExitStatus();
     if (m_process->HasExited())
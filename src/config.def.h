@@ -14,6 +14,49 @@ const unsigned int worddelimiters[] = {' ', 0};
 static unsigned int doubleclicktimeout = 300;
 static unsigned int tripleclicktimeout = 600;
 
+/*
+ * synchronized update timeout (in milliseconds): the longest drawing is held
+ * back after an application begins an update (DECSET 2026) without ending it
+ */
+static unsigned int synctimeout = 200;
+
+/*
+ * longest OSC/DCS/APC/PM string (in bytes), longer ones are dropped without
+ * being buffered further. OSC 52 clipboard payloads are the largest in use.
+ */
+static size_t strmaxlen = 4 * 1024 * 1024;
+
+/*
+ * time (in milliseconds) spent on the primary screen after which the
+ * alternate screen is freed. It is allocated again when next shown.
+ */
+static unsigned int altreleasetimeout = 60000;
+
+/*
+ * scrollback: lines kept per terminal, and memory (in bytes) taken by the
+ * scrollback of all terminals together. Past it the oldest lines of any
+ * terminal are written to a file in $TMPDIR if histspill is set, dropped
+ * otherwise.
+ */
+static int histsize = 100000;
+static size_t histmaxmem = 256 * 1024 * 1024;
+static int histspill = 1;
+
+/*
+ * newest scrollback lines kept as plain cells, older ones are packed and
+ * only unpacked when they are looked at
+ */
+static int histhot = 2000;
+
+/*
+ * cells of the screen and the scrollback a search looks at per SearchStep,
+ * so searching a long scrollback does not hold up a frame. Cells that are
+ * unpacked, or run through the regex, count several times: a step takes
+ * about 0.5 ms on a 2 GHz core, more when the spill file must be read
+ * from disk
+ */
+static int searchstep = 256 * 1024;
+
 /*
  * bell volume. It must be a value between -100 and 100. Use 0 for disabling
  * it
@@ -0,0 +1,198 @@
+/*
+ * Escape sequence parser, modelled after the DEC ANSI parser state machine
+ * (https://vt100.net/emu/dec_ansi_parser). Every character is mapped to a
+ * class, and a single lookup in vtparse gives the action to perform and the
+ * next state. Both tables are built at compile time. They live apart from the
+ * emulator so that examples/parsebench can time them on their own.
+ */
+#pragma once
+
+#include "Hexe/Terminal/Types.h"
+
+namespace Hexe
+{
+    namespace Terminal
+    {
+        enum vt_class
+        {
+            CL_C0,     /* C0 controls and DEL */
+            CL_BEL,    /* BEL, also terminates strings */
+            CL_CAN,    /* CAN, aborts sequences */
+            CL_SUB,    /* SUB, aborts sequences */
+            CL_ESC,    /* ESC */
+            CL_INTER,  /* intermediates 0x20 - 0x2f */
+            CL_PARAM,  /* parameter digits */
+            CL_SEP,    /* parameter separators ':' and ';' */
+            CL_PRIV,   /* private markers 0x3c - 0x3f */
+            CL_FINAL,  /* other finals 0x40 - 0x7e */
+            CL_CSI,    /* '[' */
+            CL_STR,    /* ']', 'P', '^', '_' and 'k' */
+            CL_BSLASH, /* '\\' */
+            CL_C1,     /* C1 controls */
+            CL_C1STR,  /* C1 DCS, OSC, PM and APC */
+            CL_ST,     /* C1 ST */
+            CL_HIGH,   /* everything from 0xa0 and up */
+            CL_NCLASSES
+        };
+
+        enum vt_action
+        {
+            ACT_NONE,
+            ACT_PRINT,
+            ACT_EXECUTE,
+            ACT_CLEAR,
+            ACT_COLLECT,
+            ACT_PRIV,
+            ACT_PARAM,
+            ACT_SEP,
+            ACT_ESC_DISPATCH,
+            ACT_CSI_DISPATCH,
+            ACT_STR_START,
+            ACT_STR_PUT,
+            ACT_STR_DISPATCH
+        };
+
+        struct VTClassTable
+        {
+            uchar c[0xa0];
+        };
+
+        struct VTParseTable
+        {
+            uchar t[ESC_NSTATES][CL_NCLASSES];
+        };
+
+        #define VT(action, state) ((uchar)((action) << 4 | (state)))
+        #define VT_ACTION(t) ((t) >> 4)
+        #define VT_STATE(t) ((t)&0xf)
+
+        static constexpr VTClassTable
+        vtclassbuild(void)
+        {
+            VTClassTable tab{};
+            int i = 0;
+
+            for (i = 0; i < 0xa0; i++)
+            {
+                if (i < 0x20 || i == 0x7f)
+                    tab.c[i] = CL_C0;
+                else if (i < 0x30)
+                    tab.c[i] = CL_INTER;
+                else if (i < 0x3a)
+                    tab.c[i] = CL_PARAM;
+                else if (i < 0x3c)
+                    tab.c[i] = CL_SEP;
+                else if (i < 0x40)
+                    tab.c[i] = CL_PRIV;
+                else if (i < 0x7f)
+                    tab.c[i] = CL_FINAL;
+                else
+                    tab.c[i] = CL_C1;
+            }
+            tab.c['\a'] = CL_BEL;
+            tab.c['\030'] = CL_CAN;
+            tab.c['\032'] = CL_SUB;
+            tab.c['\033'] = CL_ESC;
+            tab.c['['] = CL_CSI;
+            tab.c[']'] = tab.c['P'] = tab.c['^'] = tab.c['_'] = tab.c['k'] = CL_STR;
+            tab.c['\\'] = CL_BSLASH;
+            tab.c[0x90] = tab.c[0x9d] = tab.c[0x9e] = tab.c[0x9f] = CL_C1STR;
+            tab.c[0x9c] = CL_ST;
+
+            return tab;
+        }
+
+        static constexpr VTParseTable
+        vtparsebuild(void)
+        {
+            VTParseTable tab{};
+            int s = 0, c = 0;
+
+            for (s = 0; s < ESC_NSTATES; s++)
+            {
+                /* anywhere: controls execute, ESC restarts, CAN and SUB abort */
+                for (c = 0; c < CL_NCLASSES; c++)
+                    tab.t[s][c] = VT(ACT_NONE, s);
+                tab.t[s][CL_C0] = VT(ACT_EXECUTE, s);
+                tab.t[s][CL_BEL] = VT(ACT_EXECUTE, s);
+                tab.t[s][CL_CAN] = VT(ACT_EXECUTE, ESC_GROUND);
+                tab.t[s][CL_SUB] = VT(ACT_EXECUTE, ESC_GROUND);
+                tab.t[s][CL_ESC] = VT(ACT_CLEAR, ESC_ESCAPE);
+                tab.t[s][CL_C1] = VT(ACT_EXECUTE, s);
+                tab.t[s][CL_C1STR] = VT(ACT_STR_START, ESC_STR);
+                tab.t[s][CL_ST] = VT(ACT_EXECUTE, s);
+            }
+
+            for (c = CL_INTER; c <= CL_BSLASH; c++)
+            {
+                tab.t[ESC_GROUND][c] = VT(ACT_PRINT, ESC_GROUND);
+
+                tab.t[ESC_ESCAPE][c] = VT(ACT_ESC_DISPATCH, ESC_GROUND);
+                tab.t[ESC_ESCAPE_INTER][c] = VT(ACT_ESC_DISPATCH, ESC_GROUND);
+
+                tab.t[ESC_CSI_ENTRY][c] = VT(ACT_CSI_DISPATCH, ESC_GROUND);
+                tab.t[ESC_CSI_PARAM][c] = VT(ACT_CSI_DISPATCH, ESC_GROUND);
+                tab.t[ESC_CSI_INTER][c] = VT(ACT_CSI_DISPATCH, ESC_GROUND);
+                tab.t[ESC_CSI_IGNORE][c] = VT(ACT_NONE, ESC_GROUND);
+
+                tab.t[ESC_STR][c] = VT(ACT_STR_PUT, ESC_STR);
+            }
+            tab.t[ESC_GROUND][CL_HIGH] = VT(ACT_PRINT, ESC_GROUND);
+
+            tab.t[ESC_ESCAPE][CL_INTER] = VT(ACT_COLLECT, ESC_ESCAPE_INTER);
+            tab.t[ESC_ESCAPE][CL_CSI] = VT(ACT_NONE, ESC_CSI_ENTRY); /* cleared at ESC */
+            tab.t[ESC_ESCAPE][CL_STR] = VT(ACT_STR_START, ESC_STR);
+            tab.t[ESC_ESCAPE][CL_HIGH] = VT(ACT_ESC_DISPATCH, ESC_GROUND);
+            tab.t[ESC_ESCAPE_INTER][CL_INTER] = VT(ACT_COLLECT, ESC_ESCAPE_INTER);
+            tab.t[ESC_ESCAPE_INTER][CL_HIGH] = VT(ACT_ESC_DISPATCH, ESC_GROUND);
+
+            /* parameters are accumulated as they arrive, nothing is buffered */
+            tab.t[ESC_CSI_ENTRY][CL_PARAM] = VT(ACT_PARAM, ESC_CSI_PARAM);
+            tab.t[ESC_CSI_ENTRY][CL_SEP] = VT(ACT_SEP, ESC_CSI_PARAM);
+            tab.t[ESC_CSI_ENTRY][CL_PRIV] = VT(ACT_PRIV, ESC_CSI_PARAM);
+            tab.t[ESC_CSI_ENTRY][CL_INTER] = VT(ACT_COLLECT, ESC_CSI_INTER);
+            tab.t[ESC_CSI_ENTRY][CL_HIGH] = VT(ACT_NONE, ESC_CSI_IGNORE);
+            tab.t[ESC_CSI_PARAM][CL_PARAM] = VT(ACT_PARAM, ESC_CSI_PARAM);
+            tab.t[ESC_CSI_PARAM][CL_SEP] = VT(ACT_SEP, ESC_CSI_PARAM);
+            tab.t[ESC_CSI_PARAM][CL_PRIV] = VT(ACT_NONE, ESC_CSI_IGNORE);
+            tab.t[ESC_CSI_PARAM][CL_INTER] = VT(ACT_COLLECT, ESC_CSI_INTER);
+            tab.t[ESC_CSI_PARAM][CL_HIGH] = VT(ACT_NONE, ESC_CSI_IGNORE);
+            /* a single intermediate is all that is implemented */
+            tab.t[ESC_CSI_INTER][CL_INTER] = VT(ACT_NONE, ESC_CSI_IGNORE);
+            tab.t[ESC_CSI_INTER][CL_PARAM] = VT(ACT_NONE, ESC_CSI_IGNORE);
+            tab.t[ESC_CSI_INTER][CL_SEP] = VT(ACT_NONE, ESC_CSI_IGNORE);
+            tab.t[ESC_CSI_INTER][CL_PRIV] = VT(ACT_NONE, ESC_CSI_IGNORE);
+            tab.t[ESC_CSI_INTER][CL_HIGH] = VT(ACT_NONE, ESC_CSI_IGNORE);
+            tab.t[ESC_CSI_IGNORE][CL_INTER] = VT(ACT_NONE, ESC_CSI_IGNORE);
+            tab.t[ESC_CSI_IGNORE][CL_PARAM] = VT(ACT_NONE, ESC_CSI_IGNORE);
+            tab.t[ESC_CSI_IGNORE][CL_SEP] = VT(ACT_NONE, ESC_CSI_IGNORE);
+            tab.t[ESC_CSI_IGNORE][CL_PRIV] = VT(ACT_NONE, ESC_CSI_IGNORE);
+
+            /*
+             * strings take every character up to BEL, ST or ESC '\\'; other C1
+             * controls, CAN and SUB abort them
+             */
+            tab.t[ESC_STR][CL_C0] = VT(ACT_STR_PUT, ESC_STR);
+            tab.t[ESC_STR][CL_HIGH] = VT(ACT_STR_PUT, ESC_STR);
+            tab.t[ESC_STR][CL_BEL] = VT(ACT_STR_DISPATCH, ESC_GROUND);
+            tab.t[ESC_STR][CL_ESC] = VT(ACT_CLEAR, ESC_STR_ESC);
+            tab.t[ESC_STR][CL_C1] = VT(ACT_EXECUTE, ESC_GROUND);
+            tab.t[ESC_STR][CL_ST] = VT(ACT_STR_DISPATCH, ESC_GROUND);
+
+            /* the pending string is dropped unless ESC is followed by '\\' */
+            for (c = 0; c < CL_NCLASSES; c++)
+                tab.t[ESC_STR_ESC][c] = tab.t[ESC_ESCAPE][c];
+            tab.t[ESC_STR_ESC][CL_C0] = VT(ACT_EXECUTE, ESC_STR_ESC);
+            tab.t[ESC_STR_ESC][CL_ESC] = VT(ACT_CLEAR, ESC_STR_ESC);
+            tab.t[ESC_STR_ESC][CL_C1] = VT(ACT_EXECUTE, ESC_STR_ESC);
+            tab.t[ESC_STR_ESC][CL_ST] = VT(ACT_EXECUTE, ESC_STR_ESC);
+            tab.t[ESC_STR_ESC][CL_BEL] = VT(ACT_STR_DISPATCH, ESC_GROUND);
+            tab.t[ESC_STR_ESC][CL_BSLASH] = VT(ACT_STR_DISPATCH, ESC_GROUND);
+
+            return tab;
+        }
+
+        static constexpr VTClassTable vtclass = vtclassbuild();
+        static constexpr VTParseTable vtparse = vtparsebuild();
+    } // namespace Terminal
+} // namespace Hexe
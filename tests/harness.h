@@ -0,0 +1,181 @@
+/*
+ * What the tests share. The emulator is included whole, so a test can turn
+ * the knobs of config.def.h (histmaxmem, histhot, ...) before it creates a
+ * terminal and look at the static state behind it, such as histpool.
+ *
+ * A terminal reads what a test feeds it from a pty that never blocks, and
+ * draws to a display that keeps the text of every row.
+ */
+#pragma once
+
+#include "TerminalEmulator.cpp"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+static int failures;
+
+#define CHECK(c)                                                   \
+  do                                                               \
+  {                                                                \
+    if (!(c))                                                      \
+    {                                                              \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #c); \
+      failures++;                                                  \
+    }                                                              \
+  } while (0)
+
+class FeedPty : public IPseudoTerminal
+{
+public:
+  FeedPty(int columns, int rows) : m_pos(0), m_columns(columns), m_rows(rows) {}
+
+  bool IsTTY() const override { return true; }
+  int Write(const char *, size_t n) override { return (int)n; }
+  int Read(char *buf, size_t n, bool) override
+  {
+    n = MIN(n, m_s.size() - m_pos);
+    memcpy(buf, m_s.data() + m_pos, n);
+    m_pos += n;
+    return (int)n;
+  }
+  int GetNumColumns() const override { return m_columns; }
+  int GetNumRows() const override { return m_rows; }
+  bool Resize(int columns, int rows) override
+  {
+    m_columns = columns;
+    m_rows = rows;
+    return true;
+  }
+
+  void Feed(const std::string &s)
+  {
+    m_s.erase(0, m_pos);
+    m_pos = 0;
+    m_s += s;
+  }
+  bool Done() const { return m_pos == m_s.size(); }
+
+private:
+  std::string m_s;
+  size_t m_pos;
+  int m_columns, m_rows;
+};
+
+class IdleProcess : public Hexe::System::IProcess
+{
+public:
+  void CheckExitStatus() override {}
+  bool HasExited() const override { return false; }
+  int GetExitCode() const override { return 0; }
+  void Terminate() override {}
+  void WaitForExit() override {}
+};
+
+/* the rows last drawn, utf8 without trailing blanks, and which are soft wrapped */
+class TextDisplay : public TerminalDisplay
+{
+public:
+  bool DrawBegin(int columns, int rows) override
+  {
+    m_rows.resize(rows);
+    m_wrapped.resize(rows);
+    m_columns = columns;
+    return true;
+  }
+  void DrawLine(Line line, int x1, int y, int x2) override
+  {
+    std::string &s = m_rows[y];
+    char buf[UTF_SIZ];
+    int x;
+
+    s.clear();
+    m_wrapped[y] = false;
+    for (x = 0; x < m_columns; x++)
+    {
+      if (!(line[x].mode & ATTR_WDUMMY))
+        s.append(buf, utf8encode(line[x].mode & ATTR_CLUSTER ? '*' : line[x].u, buf));
+      /* a scrollback row cut before a wide char has it on its last cell */
+      if (line[x].mode & ATTR_WRAP)
+        m_wrapped[y] = true;
+    }
+    while (!s.empty() && s.back() == ' ')
+      s.pop_back();
+    (void)x1;
+    (void)x2;
+  }
+  void DrawCursor(int, int, Glyph, int, int, Glyph) override {}
+  void DrawEnd() override {}
+
+  const std::string &Row(int y) const { return m_rows[y]; }
+  bool Wrapped(int y) const { return m_wrapped[y]; }
+
+private:
+  std::vector<std::string> m_rows;
+  std::vector<bool> m_wrapped;
+  int m_columns = 0;
+};
+
+class TestTerminal
+{
+public:
+  TestTerminal(int columns, int rows)
+      : pty(new FeedPty(columns, rows)), display(std::make_shared<TextDisplay>()),
+        terminal(TerminalEmulator::Create(std::unique_ptr<IPseudoTerminal>(pty),
+                                          std::unique_ptr<Hexe::System::IProcess>(new IdleProcess()),
+                                          display))
+  {
+  }
+
+  void Feed(const std::string &s)
+  {
+    pty->Feed(s);
+    while (!pty->Done())
+      terminal->Update();
+  }
+
+  /* row y of the screen scrolled back by offset rows */
+  std::string Row(int y, int offset = 0)
+  {
+    display->SetScrollOffset(offset);
+    terminal->Update();
+    return display->Row(y);
+  }
+
+  /* the lines of the scrollback and the screen, joined at their soft wraps */
+  std::vector<std::string> Lines()
+  {
+    std::vector<std::string> lines;
+    std::string s;
+    int offset, y;
+
+    /* the rows of the scrollback one by one at the top, then the screen */
+    for (offset = terminal->GetNumHistoryLines(); offset >= 0; offset--)
+    {
+      for (y = 0; y < (offset ? 1 : pty->GetNumRows()); y++)
+      {
+        s += Row(y, offset);
+        if (!display->Wrapped(y))
+        {
+          lines.push_back(s);
+          s.clear();
+        }
+      }
+    }
+    while (!lines.empty() && lines.back().empty())
+      lines.pop_back();
+    return lines;
+  }
+
+  FeedPty *pty;
+  std::shared_ptr<TextDisplay> display;
+  std::unique_ptr<TerminalEmulator> terminal;
+};
+
+static int report(void)
+{
+  if (failures)
+    printf("%d checks failed\n", failures);
+  return failures != 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * Sequences whose effect depends on what came before them: REP repeats the
+ * last printed character only if nothing but sequences came after it.
+ */
+#include "harness.h"
+
+#define COLS 40
+#define ROWS 10
+
+static void rep(void)
+{
+  TestTerminal t(COLS, ROWS);
+
+  t.Feed("ab\033[3b");
+  CHECK(t.Row(0) == "abbbb");
+
+  /* a control code in between, or a string it terminates, stops it */
+  t.Feed("\r\nab\r\033[3b");
+  CHECK(t.Row(1) == "ab");
+  t.Feed("\r\nab\033]0;title\a\033[3b");
+  CHECK(t.Row(2) == "ab");
+  t.Feed("\r\nab\033[1m\033[3b");
+  CHECK(t.Row(3) == "abbbb");
+}
+
+int main()
+{
+  rep();
+
+  return report();
+}
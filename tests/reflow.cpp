@@ -0,0 +1,72 @@
+/*
+ * Resizing reflows the soft wrapped lines of the screen and the scrollback:
+ * at any width, down to a single column, and written at any width, they
+ * read back as they were written, wide chars included.
+ */
+#include "harness.h"
+
+#define COLS 40
+#define ROWS 10
+
+/* line i, ASCII and CJK mixed so that wide chars land on every column */
+static std::string line(int i)
+{
+  std::string s = "L" + std::to_string(i) + ":";
+  unsigned int x = i * 2654435761u;
+  int n = (int)s.size() + (x >> 24) % 30;
+  char buf[UTF_SIZ];
+
+  for (int cells = (int)s.size(); cells < n; x = x * 1103515245 + 12345)
+  {
+    if ((x >> 16) % 3)
+    {
+      s += (char)('a' + (x >> 20) % 26);
+      cells++;
+    }
+    else
+    {
+      s.append(buf, utf8encode(0x4E00 + (x >> 20) % 0x100, buf));
+      cells += 2;
+    }
+  }
+  return s;
+}
+
+static void checklines(TestTerminal &t, int n)
+{
+  std::vector<std::string> want;
+
+  for (int i = 0; i < n; i++)
+    want.push_back(line(i));
+  CHECK(t.Lines() == want);
+}
+
+static void reflow(void)
+{
+  static const int widths[] = {13, 3, 1, 2, 4, 80, 7};
+  TestTerminal t(COLS, ROWS);
+  int n = 0, i;
+
+  for (; n < 60; n++)
+    t.Feed(line(n) + "\r\n");
+  for (int w : widths)
+  {
+    t.terminal->Resize(w, ROWS);
+    checklines(t, n);
+
+    /* lines written at this width reflow too */
+    for (i = 0; i < 20; i++, n++)
+      t.Feed(line(n) + "\r\n");
+    checklines(t, n);
+
+    t.terminal->Resize(COLS, ROWS);
+    checklines(t, n);
+  }
+}
+
+int main()
+{
+  reflow();
+
+  return report();
+}
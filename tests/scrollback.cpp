@@ -0,0 +1,97 @@
+/*
+ * The scrollback under histmaxmem: lines spilled to the temp file read back
+ * as they were written, and making room never throws away what was spilled.
+ */
+#include "harness.h"
+
+#define COLS 40
+#define ROWS 10
+
+/* line i, with a tail that does not compress to nothing */
+static std::string line(int i)
+{
+  std::string s = "line " + std::to_string(i) + " ";
+  unsigned int x = i * 2654435761u;
+
+  while (s.size() < COLS - 1)
+  {
+    s += (char)('a' + (x >> 27) % 26);
+    x = x * 1103515245 + 12345;
+  }
+  return s;
+}
+
+static std::string lines(int from, int to)
+{
+  std::string s;
+
+  for (int i = from; i < to; i++)
+    s += line(i) + "\r\n";
+  return s;
+}
+
+/* whether lines 0 to n-1 are all kept, n-1 the last one pushed */
+static void checklines(TestTerminal &t, int n)
+{
+  int rows = t.terminal->GetNumHistoryLines();
+  int i;
+
+  CHECK(rows == n);
+  for (i = 0; i < n; i += 1 + n / 50)
+    CHECK(t.Row(0, rows - i) == line(i));
+  CHECK(t.Row(0, 1) == line(n - 1));
+  t.Row(0);
+}
+
+/* far more than fits: the oldest pages go to the spill file */
+static void spill(void)
+{
+  TestTerminal t(COLS, ROWS);
+  int n;
+
+  t.Feed(lines(0, 20000));
+  n = 20000 - (ROWS - 1);
+  checklines(t, n);
+  CHECK(histpool.siz <= histmaxmem);
+
+  /*
+   * A writer too far behind to take another page: room can only be made
+   * by dropping pages, and pages written out take none. The pool goes
+   * over histmaxmem for a while instead.
+   */
+  histpool.pending += histmaxmem;
+  t.Feed(lines(20000, 30000));
+  n = 30000 - (ROWS - 1);
+  histpool.pending -= histmaxmem;
+  checklines(t, n);
+
+  /* once it caught up, the pool is back under histmaxmem */
+  t.Feed(lines(30000, 31000));
+  n = 31000 - (ROWS - 1);
+  checklines(t, n);
+  CHECK(histpool.siz <= histmaxmem);
+}
+
+/* all of it hot: under pressure raw pages are packed and spilled too */
+static void hot(void)
+{
+  TestTerminal t(COLS, ROWS);
+
+  histhot = histsize;
+  t.Feed(lines(0, 20000));
+  checklines(t, 20000 - (ROWS - 1));
+  CHECK(histpool.siz <= histmaxmem);
+  histhot = 200;
+}
+
+int main()
+{
+  histmaxmem = 8 * HIST_PAGE_SIZ;
+  histhot = 200;
+  histsize = 100000;
+
+  spill();
+  hot();
+
+  return report();
+}
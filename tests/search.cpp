@@ -0,0 +1,103 @@
+/*
+ * A search of the screen and a scrollback that is packed, spilled and many
+ * pages long finds every match, newest first, at the cells that hold it,
+ * matches cut by a soft wrap included.
+ */
+#include "harness.h"
+
+#define COLS 40
+#define ROWS 10
+
+/* every 97th line has a needle, cut in two by the wrap at COLS */
+static std::string line(int i)
+{
+  std::string s = "line " + std::to_string(i) + " ";
+  unsigned int x = i * 2654435761u;
+  size_t n = i % 97 ? COLS - 1 : COLS - 4;
+
+  while (s.size() < n)
+  {
+    s += (char)('a' + (x >> 27) % 26);
+    x = x * 1103515245 + 12345;
+  }
+  if (i % 97 == 0)
+    s += "needle" + std::to_string(i) + " end";
+  return s;
+}
+
+/* the text of match m, from the rows on the screen or in the scrollback */
+static std::string text(TestTerminal &t, const SearchMatch &m)
+{
+  std::string s, row;
+  uint y;
+  int r, x0, x1;
+
+  for (y = m.y0; y - m.y0 <= m.y1 - m.y0; y++)
+  {
+    r = t.terminal->GetScreenRow(y);
+    row = r < 0 ? t.Row(0, -r) : t.Row(r);
+    x0 = y == m.y0 ? m.x0 : 0;
+    x1 = y == m.y1 ? m.x1 : (int)row.size() - 1;
+    if (x0 > x1 || x1 >= (int)row.size())
+      return "<bad>";
+    s += row.substr(x0, x1 - x0 + 1);
+  }
+  t.Row(0);
+  return s;
+}
+
+static void search(TestTerminal &t, const char *pattern, int flags, int n)
+{
+  std::vector<std::string> want, got;
+  std::vector<SearchMatch> found;
+  SearchMatch m[8];
+  int i, k, steps = 0;
+
+  for (i = n - 1; i >= 0; i--)
+  {
+    if (i % 97 == 0)
+      want.push_back("needle" + std::to_string(i));
+  }
+
+  CHECK(t.terminal->SearchStart(pattern, flags) == 0);
+  while ((k = t.terminal->SearchStep(m, LEN(m))) >= 0)
+  {
+    found.insert(found.end(), m, m + k);
+    steps++;
+  }
+  for (const SearchMatch &f : found)
+  {
+    got.push_back(text(t, f));
+    CHECK(f.y1 == f.y0 + 1);
+  }
+  CHECK(got == want);
+  /* searchstep spreads it over many steps */
+  CHECK(steps > 10);
+}
+
+static void scrollback(void)
+{
+  TestTerminal t(COLS, ROWS);
+  std::string s;
+  int n = 20000;
+
+  for (int i = 0; i < n; i++)
+    s += line(i) + "\r\n";
+  t.Feed(s);
+  CHECK(histpool.siz <= histmaxmem);
+
+  search(t, "needle[0-9]+", 0, n);
+  search(t, "NEEDLE\\d+", SEARCH_ICASE, n);
+}
+
+int main()
+{
+  histmaxmem = 8 * HIST_PAGE_SIZ;
+  histhot = 200;
+  histsize = 100000;
+  searchstep = 16 * 1024;
+
+  scrollback();
+
+  return report();
+}
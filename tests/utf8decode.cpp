@@ -0,0 +1,107 @@
+/*
+ * utf8decodebatch against utf8decode: for any input, and any room left for
+ * runes, the batch decodes the same runes of the same lengths, and stops at
+ * the same byte, as calling utf8decode rune by rune.
+ */
+#include "harness.h"
+
+static unsigned int seed = 4242;
+
+static unsigned int rnd(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+/* u encoded in n bytes, overlong if n is more than it takes */
+static void encode(std::string &s, Rune u, int n = 0)
+{
+  static const uchar lead[] = {0, 0, 0xC0, 0xE0, 0xF0};
+  int i;
+
+  if (!n)
+    n = u < 0x80 ? 1 : u < 0x800 ? 2 : u < 0x10000 ? 3 : 4;
+  if (n == 1)
+  {
+    s += (char)u;
+    return;
+  }
+  s += (char)(lead[n] | (u >> (6 * (n - 1))));
+  for (i = n - 2; i >= 0; i--)
+    s += (char)(0x80 | ((u >> (6 * i)) & 0x3F));
+}
+
+/*
+ * mostly text of one kind, as a program writes it: ASCII, CJK, emoji and
+ * other scripts; from kind 3 on with overlong forms, surrogates and runes
+ * past U+10FFFF, from kind 4 on with stray bytes and cut sequences
+ */
+static std::string text(size_t len, int kind)
+{
+  std::string s, t;
+  int r;
+
+  while (s.size() < len)
+  {
+    r = rnd() % 100;
+    if (kind == 0 || r < 30)
+      s += (char)(0x20 + rnd() % 95);
+    else if (r < 50)
+      encode(s, 0x4E00 + rnd() % 0x5000);
+    else if (r < 60)
+      encode(s, 0x1F600 + rnd() % 0x100);
+    else if (r < 70)
+      encode(s, 0x80 + rnd() % 0x780);
+    else if (r < 75 && kind >= 3)
+      encode(s, rnd() % 0x80, 2 + rnd() % 3);
+    else if (r < 78 && kind >= 3)
+      encode(s, 0xD800 + rnd() % 0x800);
+    else if (r < 80 && kind >= 3)
+      encode(s, 0x110000 + rnd() % 0x10000, 4);
+    else if (r < 85 && kind >= 4)
+      s += (char)(rnd() % 256);
+    else if (r < 88 && kind >= 4)
+    {
+      t.clear();
+      encode(t, 0x4E00 + rnd() % 100);
+      s += t.substr(0, 1 + rnd() % 2);
+    }
+    else
+      encode(s, rnd() % 0x110000);
+  }
+  return s;
+}
+
+static void compare(const std::string &s, size_t maxu)
+{
+  std::vector<Rune> want, got(maxu);
+  std::vector<uchar> wantlen, gotlen(maxu);
+  size_t i = 0, len, k, used;
+  Rune u;
+
+  while (i < s.size() && want.size() < maxu)
+  {
+    if (!(len = utf8decode(s.data() + i, &u, s.size() - i)))
+      break;
+    want.push_back(u);
+    wantlen.push_back(len);
+    i += len;
+  }
+
+  k = utf8decodebatch(s.data(), s.size(), got.data(), gotlen.data(), maxu, &used);
+  got.resize(k);
+  gotlen.resize(k);
+  CHECK(got == want);
+  CHECK(gotlen == wantlen);
+  CHECK(used == i);
+}
+
+int main()
+{
+  int i;
+
+  for (i = 0; i < 50000 && !failures; i++)
+    compare(text(rnd() % 200, rnd() % 6), 1 + rnd() % 300);
+
+  return report();
+}
@@ -0,0 +1,160 @@
+#!/bin/env python
+
+# Generates src/unicode_props.h, a two-level table packing the properties the
+# emulator needs per code point into one byte, so a character is classified
+# with a single lookup:
+#   bits 0-1: display width + 1 (0 = non-printable, 1 = zero width, 2, 3)
+#   bit 2:    emoji presentation
+#   bit 3:    boxdraw glyph (U+2500 block entries with shape data, braille)
+#
+# The first stage maps (code point >> SHIFT) to a block number, the second
+# stage holds the deduplicated blocks of 1 << SHIFT entries.
+#
+# By default the widths come from src/nonspacing.h and src/wide.h and the
+# emoji set from src/emoji_blocks.h. Passing an emoji-sequences.txt file
+# (as used by gen-emoji-headers.py) takes the emoji set from it instead:
+#
+#   python tools/gen-unicode-props.py [emoji-sequences.txt]
+
+import os
+import re
+import sys
+
+SHIFT = 8
+MAXCODE = 0x110000
+
+PROP_EMOJI = 4
+PROP_BOXDRAW = 8
+
+root = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+
+
+def readsrc(name):
+    with open(os.path.join(root, 'src', name), 'r', encoding='utf-8') as fil:
+        return re.sub(r'/\*.*?\*/', '', fil.read(), flags=re.S)
+
+
+def readbytes(name):
+    return [int(x, 0) for x in readsrc(name).replace('\n', ' ').split(',') if x.strip()]
+
+
+def reademojiblocks():
+    emoji = set()
+    for lo, hi, bits in re.findall(r'=\s*{\s*(0x[0-9a-fA-F]+),\s*(0x[0-9a-fA-F]+),\s*{([^}]*)}', readsrc('emoji_blocks.h')):
+        lo = int(lo, 16)
+        hi = int(hi, 16)
+        bitmap = [int(x, 16) for x in bits.replace('\n', ' ').split(',') if x.strip()]
+        for code in range(lo, hi + 1):
+            ofs = code - lo
+            if bitmap[ofs // 8] & (1 << (ofs % 8)):
+                emoji.add(code)
+    return emoji
+
+
+def reademojisequences(path):
+    emoji = set()
+    with open(path, 'r', encoding='utf-8') as fil:
+        for lin in fil:
+            tokens = [x.strip() for x in lin.split('#')[0].split(';')]
+            if len(tokens) < 2 or tokens[1] != 'Basic_Emoji' or ' ' in tokens[0]:
+                continue
+            bounds = tokens[0].split('..')
+            for code in range(int(bounds[0], 16), int(bounds[-1], 16) + 1):
+                if code <= 0x1FFFF:
+                    emoji.add(code)
+    return emoji
+
+
+def readboxdraw():
+    body = readsrc('boxdraw_data.h')
+    body = body[body.index('boxdata[256]'):]
+    body = body[body.index('{') + 1:body.index('}')]
+    entries = [x.strip() for x in body.split(',')]
+    box = set(0x2500 + i for i, x in enumerate(entries[:256]) if x and x != '0')
+    box.update(range(0x2800, 0x2900))
+    return box
+
+
+def mkwidth(emoji):
+    table = readbytes('nonspacing.h')
+    wtable = readbytes('wide.h')
+
+    def inbitmap(tab, wc):
+        return (tab[tab[wc >> 8] * 32 + ((wc & 255) >> 3)] >> (wc & 7)) & 1
+
+    def width(wc):
+        if wc < 0xff:
+            return 1 if ((wc + 1) & 0x7f) >= 0x21 else -1 if wc else 0
+        if wc in emoji:
+            return 2
+        if (wc & 0xfffeffff) < 0xfffe:
+            if inbitmap(table, wc):
+                return 0
+            if inbitmap(wtable, wc):
+                return 2
+            return 1
+        if (wc & 0xfffe) == 0xfffe:
+            return -1
+        if 0x20000 <= wc < 0x40000:
+            return 2
+        if wc == 0xe0001 or 0xe0020 <= wc < 0xe0020 + 0x5f or 0xe0100 <= wc < 0xe0100 + 0xef:
+            return 0
+        return 1
+
+    return width
+
+
+def genprops(emoji, box):
+    width = mkwidth(emoji)
+    props = bytearray(MAXCODE)
+    for code in range(MAXCODE):
+        p = width(code) + 1
+        if code in emoji:
+            p |= PROP_EMOJI
+        if code in box:
+            p |= PROP_BOXDRAW
+        props[code] = p
+    return props
+
+
+def gentables(props):
+    size = 1 << SHIFT
+    blocks = {}
+    stage1 = []
+    stage2 = []
+    for ofs in range(0, MAXCODE, size):
+        block = bytes(props[ofs:ofs + size])
+        if block not in blocks:
+            blocks[block] = len(stage2)
+            stage2.append(block)
+        stage1.append(blocks[block])
+    return stage1, stage2
+
+
+def writearray(fil, values, perline):
+    for i in range(0, len(values), perline):
+        fil.write('    ' + ', '.join(str(x) for x in values[i:i + perline]) + ',\n')
+
+
+def writeheader(path, stage1, stage2):
+    index = 'unsigned char' if len(stage2) <= 256 else 'unsigned short'
+    with open(path, 'w', encoding='utf-8', newline='\n') as fil:
+        fil.write('/* generated by tools/gen-unicode-props.py, do not edit */\n\n')
+        fil.write('#define UPROP_SHIFT {0}\n'.format(SHIFT))
+        fil.write('#define UPROP_MAX {0}\n\n'.format(hex(MAXCODE)))
+        fil.write('static constexpr {0} uprop_stage1[{1}] = {{\n'.format(index, len(stage1)))
+        writearray(fil, stage1, 24)
+        fil.write('};\n\n')
+        fil.write('static constexpr unsigned char uprop_stage2[{0}][{1}] = {{\n'.format(len(stage2), 1 << SHIFT))
+        for block in stage2:
+            fil.write('  {\n')
+            writearray(fil, list(block), 32)
+            fil.write('  },\n')
+        fil.write('};\n')
+
+
+if __name__ == "__main__":
+    emoji = reademojisequences(sys.argv[1]) if len(sys.argv) > 1 else reademojiblocks()
+    stage1, stage2 = gentables(genprops(emoji, readboxdraw()))
+    writeheader(os.path.join(root, 'src', 'unicode_props.h'), stage1, stage2)
+    print('{0} blocks, {1} bytes'.format(len(stage2), len(stage1) + len(stage2) * (1 << SHIFT)))